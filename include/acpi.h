@@ -0,0 +1,98 @@
+#ifndef _ACPI_H_
+#define _ACPI_H_
+#include <stdint.h>
+#include <stddef.h>
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oemid[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+	/* revision 2 and later */
+	uint32_t length;
+	uint64_t xsdt_address;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+};
+
+struct acpi_sdt_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oemid[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+};
+
+#define ACPI_FADT_DSDT_OFFSET 40
+#define ACPI_FADT_X_DSDT_OFFSET 140
+
+/* System resource affinity table, a list of variable length entries */
+/* following the header and 12 reserved bytes */
+#define ACPI_SRAT_ENTRIES_OFFSET 48
+#define ACPI_SRAT_PROCESSOR 0
+#define ACPI_SRAT_MEMORY 1
+#define ACPI_SRAT_X2APIC 2
+#define ACPI_SRAT_ENABLED 1
+
+struct acpi_srat_entry {
+	uint8_t type;
+	uint8_t length;
+};
+
+struct acpi_srat_processor {
+	uint8_t type;
+	uint8_t length;
+	uint8_t proximity_low;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t proximity_high[3];
+	uint32_t clock_domain;
+};
+
+/* split fields to avoid padding */
+struct acpi_srat_memory {
+	uint8_t type;
+	uint8_t length;
+	uint16_t proximity_low;
+	uint16_t proximity_high;
+	uint16_t reserved1;
+	uint32_t base_low;
+	uint32_t base_high;
+	uint32_t length_low;
+	uint32_t length_high;
+	uint32_t reserved2;
+	uint32_t flags;
+	uint32_t reserved3[2];
+};
+
+struct acpi_srat_x2apic {
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved1;
+	uint32_t proximity;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved2;
+};
+
+/* System locality information table, a 64 bit locality count followed */
+/* by a count by count matrix of relative distances */
+#define ACPI_SLIT_COUNT_OFFSET 36
+#define ACPI_SLIT_ENTRIES_OFFSET 44
+
+/* Copies every table reachable from the RSDP, and the DSDT, onto the */
+/* heap so that ACPI reclaimable memory can be handed to the physical */
+/* allocator afterwards. */
+void copy_acpi_tables(void);
+/* Returns the heap copy of the first table with the given signature, or */
+/* NULL if there is none. */
+struct acpi_sdt_header *find_acpi_table(const char *signature);
+
+#endif/*_ACPI_H_*/
@@ -0,0 +1,8 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+/* Memory benchmarks, printed to the console. They are only run at boot */
+/* when the kernel is built with -DMEMORY_BENCHMARKS. */
+void run_memory_benchmarks(void);
+
+#endif/*_BENCHMARK_H_*/
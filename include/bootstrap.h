@@ -50,12 +50,18 @@ struct init_file {
 	void *data;
 };
 
+/* the tables themselves are copied by `copy_acpi_tables()` in acpi.c */
+struct bootstrap_acpi_info {
+	uint64_t rsdp; /* physical, 0 if the firmware provided none */
+};
+
 /* in the event this structure is edited: */
 /* update `relocate_bootstrap_data()` in memory/virtual.c */
 struct bootstrap_info {
 	struct framebuffer framebuffer;
 	struct bootstrap_memory_info memory;
 	struct init_file init;
+	struct bootstrap_acpi_info acpi;
 };
 
 extern struct bootstrap_info bootstrap_info;
@@ -72,6 +72,8 @@ uint64_t read_cr3(void);
 void write_cr3(uint64_t v);
 
 void flush_page(uint64_t virt);
+/* Zeroes a page with non-temporal stores, leaving the caches alone. */
+void zero_page_nontemporal(void *page);
 
 void disable_interrupts(void);
 void enable_interrupts(void);
@@ -88,6 +90,14 @@ struct cpuid_result {
 };
 void cpuid(uint32_t eax, uint32_t ecx, struct cpuid_result *res);
 
+#define MAX_CPU_COUNT 64
+/* Index of the executing cpu, below MAX_CPU_COUNT. Only the bootstrap */
+/* processor is started for now, so this is always 0. */
+unsigned current_cpu_index(void);
+
+/* Time stamp counter, ordered after every earlier instruction. */
+uint64_t read_tsc(void);
+
 void write_msr(uint32_t msr, uint64_t value);
 uint64_t read_msr(uint32_t msr);
 
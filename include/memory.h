@@ -11,6 +11,7 @@ typedef uint64_t pte_t;
 
 #define PAGESIZE 4096
 #define PAGEMASK UINT64_C(0xfffffffffffff000)
+#define PAGE_ADDRESS_MASK UINT64_C(0x000ffffffffff000)
 #define PHYSICAL_PAGE_MAP_BASE UINT64_C(0xffff800000000000)
 #define P2VADDR(p) ((void *) ((uint64_t) (p) | PHYSICAL_PAGE_MAP_BASE))
 
@@ -20,32 +21,225 @@ typedef uint64_t pte_t;
 #define PAGE_WRITE_THROUGH 8
 #define PAGE_CACHE_DISABLE 0x10
 #define PAGE_ACCESSED 0x20
+#define PAGE_LARGE 0x80
 #define PAGE_NO_EXECUTE (UINT64_C(1) << 63)
 
 void initalize_memory(void);
 void initalize_malloc(void);
 void initalize_virtual_memory(void);
 
+/* Largest block the buddy allocator tracks, 2^18 pages (1 GiB). */
+#define PHYS_MAX_ORDER 18
+#define PHYS_ORDER_COUNT (PHYS_MAX_ORDER + 1)
+
+#define LARGE_PAGE_ORDER 9 /* 2 MiB */
+#define HUGE_PAGE_ORDER 18 /* 1 GiB */
+#define LARGE_PAGESIZE (PAGESIZE << LARGE_PAGE_ORDER)
+#define HUGE_PAGESIZE ((uint64_t) PAGESIZE << HUGE_PAGE_ORDER)
+
 #define PHYS_PAGE_ALLOC_CONSECUTIVE 1
+#define PHYS_PAGE_ALLOC_ZERO 2
+#define PHYS_PAGE_ALLOC_ALIGN(order) ((unsigned) (order) << 8)
+#define PHYS_PAGE_ALLOC_ALIGN_ORDER(flags) (((flags) >> 8) & 0xff)
+#define PHYS_PAGE_ALLOC_2M PHYS_PAGE_ALLOC_ALIGN(LARGE_PAGE_ORDER)
+#define PHYS_PAGE_ALLOC_1G PHYS_PAGE_ALLOC_ALIGN(HUGE_PAGE_ORDER)
+#define PHYS_PAGE_ALLOC_DMA_1M (1 << 16)
+#define PHYS_PAGE_ALLOC_DMA_16M (2 << 16)
+#define PHYS_PAGE_ALLOC_DMA_4G (3 << 16)
+#define PHYS_PAGE_ALLOC_DMA_LIMIT(flags) (((flags) >> 16) & 3)
 /* Allocates count physical pages and returns the pages in *pages. Accepts */
 /* a bitwise or of flags of the form PHYS_PAGE_ALLOC_*. By default count */
-/* pages are allocated and placed in the array pages. Currently, the only */
-/* flag is PHYS_PAGE_ALLOC_CONSECUTIVE which allocates count consecutive */
-/* pages, and returns the base of these pages in *pages,  rather than */
-/* writing all the values to an array. On success, 0 is returned and pages */
-/* points to an array of count pages, (unless PHYS_PAGE_ALLOC_CONSECUTIVE */
-/* is used). On error, 1 is returned and the region of pages through pages */
-/* + count is undefined. */
+/* pages are allocated and placed in the array pages. */
+/* PHYS_PAGE_ALLOC_CONSECUTIVE allocates count consecutive pages, and */
+/* returns the base of these pages in *pages, rather than writing all the */
+/* values to an array. PHYS_PAGE_ALLOC_ALIGN(order), or the shorthands */
+/* PHYS_PAGE_ALLOC_2M and PHYS_PAGE_ALLOC_1G, additionally align the base */
+/* to 2^order pages, and are only valid with PHYS_PAGE_ALLOC_CONSECUTIVE. */
+/* PHYS_PAGE_ALLOC_ZERO returns zeroed pages, taking single pages from a */
+/* pool that is zeroed ahead of time. */
+/* PHYS_PAGE_ALLOC_DMA_1M, PHYS_PAGE_ALLOC_DMA_16M and */
+/* PHYS_PAGE_ALLOC_DMA_4G only return pages that end below that address. */
+/* Memory below 16 MiB is reserved for these, other allocations only get */
+/* it when nothing else is left. */
+/* On success, 0 is returned and pages points to an array of count pages, */
+/* (unless PHYS_PAGE_ALLOC_CONSECUTIVE is used). On error, 1 is returned */
+/* and the region of pages through pages + count is undefined. */
 int allocate_physical_pages(uint64_t *pages, size_t count, unsigned flags);
 void free_consecutive_physical_pages(uint64_t page, size_t count);
+
+/* Per-frame descriptor in the page frame database, kept at 8 bytes so a */
+/* cache line covers eight consecutive frames. */
+struct page {
+	uint32_t refcount;
+	uint16_t flags;
+	uint8_t order; /* of the free block, or of the allocation it heads */
+	uint8_t owner; /* enum page_owner */
+};
+
+#define PAGE_FRAME_FREE 1 /* head of a block on a buddy free list */
+#define PAGE_FRAME_CACHED 2 /* free, held in a per-cpu page cache */
+#define PAGE_FRAME_ZEROED 4 /* free, held zeroed in the zeroed page pool */
+
+enum page_owner {
+	PAGE_OWNER_NONE,
+	PAGE_OWNER_BOOTSTRAP,
+	PAGE_OWNER_KERNEL,
+	PAGE_OWNER_PAGE_TABLE,
+	PAGE_OWNER_HEAP
+};
+
+/* Both are O(1). phys_to_page() returns NULL for frames outside the page */
+/* frame database. */
+struct page *phys_to_page(uint64_t paddr);
+uint64_t page_to_phys(struct page *page);
+/* Take and drop an extra reference on an allocated page, for sharing. The */
+/* page is freed when its last reference is dropped. */
+void get_physical_page(uint64_t page);
+void put_physical_page(uint64_t page);
+void set_physical_page_owner(uint64_t page, size_t count, enum page_owner owner);
+/* Returns every page held in the per-cpu page caches and the zeroed page */
+/* pool to the buddy lists, and the number of pages returned. */
+size_t drain_physical_page_caches(void);
+/* Zeroes a small batch of free pages into the zeroed page pool, meant to */
+/* be called when idle. Returns nonzero if any work was done. */
+int refill_zeroed_pages(void);
+/* Pages waiting in the zeroed page pool, which PHYS_PAGE_ALLOC_ZERO */
+/* hands out without clearing them. */
+size_t zeroed_physical_pages(void);
+/* Cache color of a physical or virtual address, the group of sets of */
+/* the largest data cache the page at address maps to. Pages of different */
+/* colors never conflict in that cache. There are cache_color_count() */
+/* colors, and colored_cache_size() is the size of that cache. */
+unsigned cache_color(uint64_t address);
+unsigned cache_color_count(void);
+size_t colored_cache_size(void);
+/* Allocates count single pages, where pages[i] has color color + i. */
+/* Mapping them at consecutive virtual pages starting at a page of that */
+/* color spreads the mapping evenly over the cache. Returns 0 on success, */
+/* or 1 with nothing allocated. */
+int allocate_colored_physical_pages(uint64_t *pages, size_t count, unsigned color);
+/* Initializes the next section of memory whose initialization was */
+/* deferred at boot, meant to be called when idle. Returns nonzero if a */
+/* section was initialized. */
+int initalize_deferred_memory(void);
+/* Free pages still waiting in deferred sections. */
+size_t deferred_physical_pages(void);
+
+/* Memory is split into one zone per NUMA node, as described by the ACPI */
+/* SRAT. Allocations come from the node of the allocating cpu and fall */
+/* back to the other nodes, nearest first by SLIT distance. Without an */
+/* SRAT there is a single node 0. */
+#define MAX_NUMA_NODES 16
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+/* Parses the SRAT and SLIT, after copy_acpi_tables(). */
+void initalize_numa(void);
+unsigned numa_node_count(void);
+/* Node of the first memory affinity range overlapping [base, end), or 0. */
+unsigned numa_node_of_range(uint64_t base, uint64_t end);
+/* Node of the executing cpu. */
+unsigned current_numa_node(void);
+unsigned numa_distance(unsigned from, unsigned to);
+/* Every node, ordered by distance from node, node itself first. */
+const uint8_t *numa_fallback_order(unsigned node);
+
+struct numa_node_stats {
+	size_t total_pages; /* usable memory */
+	size_t free_pages; /* in the buddy lists */
+	size_t allocations; /* blocks handed out */
+	size_t fallbacks; /* requests from the node's cpus served elsewhere */
+};
+void get_numa_node_stats(unsigned node, struct numa_node_stats *stats);
+
+struct physical_memory_stats {
+	uint64_t timestamp; /* read_tsc() when the stats were taken */
+	size_t total_pages; /* usable memory */
+	size_t free_pages; /* in the buddy lists */
+	size_t cached_pages; /* free, held in the page caches and pools */
+	size_t deferred_pages; /* free, in sections not initialized yet */
+	size_t free_blocks;
+	size_t largest_free_block; /* pages */
+	size_t free_blocks_by_order[PHYS_ORDER_COUNT];
+	/* per mille of free memory in blocks smaller than 2 MiB */
+	unsigned fragmentation_index;
+	/* counted since boot, sample twice for rates */
+	size_t allocations;
+	size_t frees;
+	size_t pages_allocated;
+	size_t pages_freed;
+	size_t failures;
+};
+void get_physical_memory_stats(struct physical_memory_stats *stats);
+
+struct physical_extent {
+	uint64_t base;
+	size_t count; /* pages */
+};
+/* Allocates count physical pages, not necessarily consecutive, as runs of */
+/* consecutive pages written to extents. Whole free blocks are carved in a */
+/* single pass, largest first, so few extents are needed. At most max */
+/* extents are written. Returns the number of extents used, or 0 if the */
+/* pages could not be allocated in max extents, in which case nothing is */
+/* allocated. */
+size_t allocate_physical_extents(struct physical_extent *extents, size_t max, size_t count);
+void free_physical_extents(struct physical_extent *extents, size_t n);
+
+/* Moves heap pages out of the way to form a free block of 2^order pages. */
+/* Consecutive allocations that find no free block compact on their own. */
+/* Returns 0 on success and 1 if no block could be freed. */
+int compact_physical_memory(unsigned order);
+
+struct compaction_stats {
+	size_t runs;
+	size_t successes;
+	size_t failures;
+	size_t blocks_scanned;
+	size_t pages_migrated;
+};
+void get_compaction_stats(struct compaction_stats *stats);
 uint64_t allocate_virtual_pages(size_t count);
 void free_virtual_pages(uint64_t base, size_t count);
 
 void relocate_bootstrap_data(void);
 void unmap_lower_memory(void);
+/* Frees the loader data frames of the paging structures uefi built, once */
+/* unmap_lower_memory() has dropped them. Returns the number of pages. */
+size_t release_uefi_page_tables(void);
+/* Frees a single page the firmware allocated as loader data, if it is */
+/* still only referenced by the bootstrap. Returns the number of pages. */
+size_t release_firmware_page(uint64_t page);
+/* Late boot reclamation, after unmap_lower_memory(). Copies what is */
+/* needed out of boot services and ACPI reclaimable memory and then frees */
+/* it, with the dropped uefi paging structures. Returns the number of */
+/* pages reclaimed. */
+size_t reclaim_boot_memory(void);
 void map_page_autoalloc(uint64_t vaddr, uint64_t paddr, uint64_t flags);
+/* Returns the frame that was mapped, or 0. */
+uint64_t unmap_page(uint64_t vaddr);
+/* Returns the frame that backs vaddr, or 0 if it is not mapped. */
+uint64_t lookup_frame(uint64_t vaddr);
+/* Whether [base, base + size) is mapped present, user and writable in */
+/* the active address space. */
+int user_range_writable(uint64_t base, size_t size);
+/* Maps count pages at vaddr to the consecutive frames at paddr, with one */
+/* walk per table and no TLB flushes, so the range must be unmapped. With */
+/* PAGE_LARGE in flags, 2 MiB pages are used where both are aligned. */
+void map_pages(uint64_t vaddr, uint64_t paddr, size_t count, uint64_t flags);
+/* Unmaps count pages at vaddr, splitting 2 MiB pages that are only partly */
+/* in the range, and passes the frames to release() in consecutive runs. */
+void unmap_pages(uint64_t vaddr, size_t count, void (*release)(uint64_t frame, size_t count));
+/* Moves the heap pages backed by frames in [base, end) to the frames */
+/* replace() returns for them, 0 leaves a page where it is. Returns the */
+/* number of pages moved. */
+size_t remap_heap_frames(uint64_t base, uint64_t end, uint64_t (*replace)(uint64_t frame));
 void bootstrap_higher_half_heap_table(void);
 void map_high_physical_memory(void);
+/* Maps the frames of [paddr, paddr + size) that map_high_physical_memory() */
+/* skipped, so physical_to_virtual() works for them too. */
+void map_high_physical_range(uint64_t paddr, size_t size);
+/* Returns a usable pointer to physical address paddr, through the identity */
+/* map before map_high_physical_memory() and the high map afterwards. */
+void *physical_to_virtual(uint64_t paddr);
 
 #define KERNEL_HEAP_BOTTOM UINT64_C(0xffffc00000000000)
 #define KERNEL_HEAP_TOP UINT64_C(0xffffd00000000000)
@@ -53,6 +247,54 @@ void map_high_physical_memory(void);
 #define KERNEL_HIGHER_HALF_BASE UINT64_C(0xffffffffc0000000)
 
 void *malloc(size_t size);
+/* alignment is a power of two. */
+void *malloc_aligned(size_t size, size_t alignment);
 void free(void *ptr);
+void *calloc(size_t count, size_t size);
+void *realloc(void *ptr, size_t size);
+/* Returns whole free pages of the heap to the page allocators until at */
+/* most keep bytes of it are free. Returns the number of bytes returned. */
+size_t trim_heap(size_t keep);
+/* Trims the heap once a lot of it is free, meant to be called when idle */
+/* so free() stays constant time. Returns nonzero if any work was done. */
+int trim_idle_heap(void);
+/* Compaction moves heap pages to other frames. Memory whose physical */
+/* address is given to hardware, or that must never move, is pinned */
+/* first. Its pages stay pinned until the heap gives them back. */
+void pin_heap_memory(void *ptr, size_t size);
+
+/* Caches of fixed size objects packed into heap pages, with no header */
+/* per object. align is a power of two, 0 for the cache line size. The */
+/* constructor, if any, is run once per object when its slab is created, */
+/* and objects must be freed back in their constructed state. */
+struct slab_cache;
+struct slab_cache *create_slab_cache(size_t size, size_t align, void (*constructor)(void *object));
+void *slab_allocate(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *object);
+/* Every object of the cache must have been freed. */
+void destroy_slab_cache(struct slab_cache *cache);
+
+/* Two-level segregated fit heaps, each over a dedicated pool of size */
+/* bytes that is mapped when it is created and never grows, for interrupt */
+/* and timer context: allocating and freeing take constant time. Pools */
+/* are not locked, so a pool must only be used by one context at a time. */
+struct tlsf_pool;
+struct tlsf_pool *create_tlsf_pool(size_t size);
+void *tlsf_allocate(struct tlsf_pool *pool, size_t size);
+void tlsf_free(struct tlsf_pool *pool, void *ptr);
+/* Every block of the pool must have been freed. */
+void destroy_tlsf_pool(struct tlsf_pool *pool);
+
+/* Pools of fixed size, physically contiguous buffers for device drivers. */
+/* flags takes one of PHYS_PAGE_ALLOC_DMA_*, or 0 for no address limit. */
+/* align is a power of two no larger than a page. Buffers no larger than */
+/* a page never cross a page boundary. */
+struct dma_pool;
+struct dma_pool *create_dma_pool(size_t size, size_t align, unsigned flags);
+/* Returns a buffer and its physical address in *paddr, or NULL. */
+void *dma_pool_allocate(struct dma_pool *pool, uint64_t *paddr);
+void dma_pool_free(struct dma_pool *pool, void *buffer);
+/* Frees every buffer of the pool, and the pool. */
+void destroy_dma_pool(struct dma_pool *pool);
 
 #endif/*_MEMORY_H_*/
@@ -0,0 +1,10 @@
+#ifndef _SYSCALL_H_
+#define _SYSCALL_H_
+
+/* The syscall number is passed in rax and the first argument in rdi. */
+/* The result is returned in rax. */
+
+/* rdi: struct physical_memory_stats * to fill in, returns 0 on success */
+#define SYSCALL_MEMORY_STATS 1
+
+#endif/*_SYSCALL_H_*/
@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "bootstrap.h"
+#include "memory.h"
+#include "terminal.h"
+#include "util.h"
+
+static struct acpi_sdt_header **acpi_tables;
+static size_t acpi_table_count;
+
+/* Firmware may keep its tables in ACPI NVS or reserved memory, which the */
+/* high map leaves out, so each table is mapped before it is read. */
+static struct acpi_sdt_header *_map_table(uint64_t paddr) {
+	struct acpi_sdt_header *table;
+
+	map_high_physical_range(paddr, sizeof(struct acpi_sdt_header));
+	table = physical_to_virtual(paddr);
+	map_high_physical_range(paddr, table->length);
+	return table;
+}
+
+static struct acpi_sdt_header *_copy_table(uint64_t paddr) {
+	struct acpi_sdt_header *src, *dst;
+
+	src = _map_table(paddr);
+	dst = malloc(src->length);
+	if (!dst)
+		panic("copy_acpi_tables(): could not allocate space for table at %p", paddr);
+	memcpy(dst, src, src->length);
+
+	return dst;
+}
+
+static void _copy_dsdt(struct acpi_sdt_header *fadt) {
+	uint64_t dsdt;
+	uint32_t dsdt32;
+
+	dsdt = 0;
+	if (fadt->length >= ACPI_FADT_X_DSDT_OFFSET + sizeof(uint64_t))
+		memcpy(&dsdt, (uint8_t *) fadt + ACPI_FADT_X_DSDT_OFFSET, sizeof(uint64_t));
+	if (!dsdt && fadt->length >= ACPI_FADT_DSDT_OFFSET + sizeof(uint32_t)) {
+		memcpy(&dsdt32, (uint8_t *) fadt + ACPI_FADT_DSDT_OFFSET, sizeof(uint32_t));
+		dsdt = dsdt32;
+	}
+
+	if (dsdt)
+		acpi_tables[acpi_table_count++] = _copy_table(dsdt);
+}
+
+void copy_acpi_tables(void) {
+	struct acpi_rsdp *rsdp;
+	struct acpi_sdt_header *root;
+	uint64_t root_address, entry;
+	uint32_t entry32;
+	size_t i, count, entry_size;
+	uint8_t *entries;
+
+	if (!bootstrap_info.acpi.rsdp)
+		return;
+
+	map_high_physical_range(bootstrap_info.acpi.rsdp, sizeof(struct acpi_rsdp));
+	rsdp = physical_to_virtual(bootstrap_info.acpi.rsdp);
+	if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+		root_address = rsdp->xsdt_address;
+		entry_size = sizeof(uint64_t);
+	} else {
+		root_address = rsdp->rsdt_address;
+		entry_size = sizeof(uint32_t);
+	}
+
+	root = _map_table(root_address);
+	count = (root->length - sizeof(struct acpi_sdt_header)) / entry_size;
+	entries = (uint8_t *) (root + 1);
+
+	/* every table, the DSDT and the root table itself */
+	acpi_tables = malloc((count + 2) * sizeof(struct acpi_sdt_header *));
+	if (!acpi_tables)
+		panic("copy_acpi_tables(): could not allocate table list");
+
+	acpi_tables[acpi_table_count++] = _copy_table(root_address);
+	for (i = 0; i < count; i++) {
+		/* entries are only 4 byte aligned */
+		if (entry_size == sizeof(uint64_t)) {
+			memcpy(&entry, entries + i * entry_size, sizeof(uint64_t));
+		} else {
+			memcpy(&entry32, entries + i * entry_size, sizeof(uint32_t));
+			entry = entry32;
+		}
+		if (!entry)
+			continue;
+
+		acpi_tables[acpi_table_count] = _copy_table(entry);
+		if (memcmp(acpi_tables[acpi_table_count++]->signature, "FACP", 4) == 0)
+			_copy_dsdt(acpi_tables[acpi_table_count - 1]);
+	}
+}
+
+struct acpi_sdt_header *find_acpi_table(const char *signature) {
+	size_t i;
+
+	for (i = 0; i < acpi_table_count; i++)
+		if (memcmp(acpi_tables[i]->signature, (void *) signature, 4) == 0)
+			return acpi_tables[i];
+	return NULL;
+}
@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "benchmark.h"
+#include "memory.h"
+#include "cpu.h"
+#include "terminal.h"
+
+#define CACHE_LINE 64
+#define COLOR_BENCHMARK_PASSES 64
+#define MALLOC_BENCHMARK_ROUNDS 4096
+#define MALLOC_BENCHMARK_BATCH 256
+#define LATENCY_BENCHMARK_ROUNDS 65536
+#define LATENCY_BENCHMARK_SLOTS 512
+#define LATENCY_BENCHMARK_POOL (4 << 20)
+
+/* Reads a byte of every cache line of [base, base + size), passes times. */
+static uint64_t _time_reads(volatile uint8_t *base, size_t size, size_t passes) {
+	uint64_t start;
+	size_t offset;
+	uint8_t sum;
+
+	sum = 0;
+	start = read_tsc();
+	while (passes--)
+		for (offset = 0; offset < size; offset += CACHE_LINE)
+			sum += base[offset];
+	(void) sum;
+	return read_tsc() - start;
+}
+
+/* Maps pages at vaddr and times reading through all of them. */
+static uint64_t _time_mapping(uint64_t vaddr, uint64_t *pages, size_t count) {
+	size_t i;
+	uint64_t cycles;
+
+	for (i = 0; i < count; i++)
+		map_page_autoalloc(vaddr + i * PAGESIZE, pages[i], PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+
+	/* one pass to fault in the TLB and caches */
+	_time_reads((uint8_t *) vaddr, count * PAGESIZE, 1);
+	cycles = _time_reads((uint8_t *) vaddr, count * PAGESIZE, COLOR_BENCHMARK_PASSES);
+
+	for (i = 0; i < count; i++)
+		unmap_page(vaddr + i * PAGESIZE);
+	return cycles;
+}
+
+/* A working set exactly the size of the colored cache fits in it when */
+/* every color is used equally, which is what colored allocation of */
+/* consecutive virtual pages gives. Scattered frames pile several pages */
+/* onto some colors and conflict miss. The baseline is the worst they */
+/* can do, every frame of a single color. */
+static void _benchmark_cache_coloring(void) {
+	size_t count, i;
+	uint64_t vaddr, *pages, colored, single;
+
+	count = colored_cache_size() / PAGESIZE;
+	if (cache_color_count() == 1) {
+		printf("Cache coloring: no cache geometry, skipped\n");
+		return;
+	}
+
+	pages = malloc(count * sizeof(uint64_t));
+	vaddr = allocate_virtual_pages(count);
+	if (!pages || !vaddr) {
+		printf("Cache coloring: could not allocate the working set\n");
+		goto out;
+	}
+
+	if (allocate_colored_physical_pages(pages, count, cache_color(vaddr))) {
+		printf("Cache coloring: could not allocate the working set\n");
+		goto out;
+	}
+
+	colored = _time_mapping(vaddr, pages, count);
+	for (i = 0; i < count; i++)
+		free_consecutive_physical_pages(pages[i], 1);
+
+	for (i = 0; i < count; i++) {
+		if (allocate_colored_physical_pages(&pages[i], 1, cache_color(vaddr))) {
+			while (i--)
+				free_consecutive_physical_pages(pages[i], 1);
+			printf("Cache coloring: could not allocate the single color working set\n");
+			goto out;
+		}
+	}
+	single = _time_mapping(vaddr, pages, count);
+	for (i = 0; i < count; i++)
+		free_consecutive_physical_pages(pages[i], 1);
+
+	printf("Cache coloring: %u colors, 0x%zx byte working set, %llu cycles colored, %llu cycles on one color\n",
+		cache_color_count(), count * PAGESIZE,
+		(unsigned long long) colored, (unsigned long long) single);
+
+out:
+	if (vaddr)
+		free_virtual_pages(vaddr, count);
+	if (pages)
+		free(pages);
+}
+
+/* Times small malloc() and free() pairs, once back to back, which the */
+/* per-cpu magazines serve on their own, and once in batches large enough */
+/* to cycle magazines through the depot. */
+static void _benchmark_malloc_throughput(void) {
+	void *batch[MALLOC_BENCHMARK_BATCH];
+	uint64_t start, pairs, batched;
+	size_t i, j;
+
+	start = read_tsc();
+	for (i = 0; i < MALLOC_BENCHMARK_ROUNDS * 16; i++)
+		free(malloc(16 + i % 16 * 16));
+	pairs = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < MALLOC_BENCHMARK_ROUNDS / 16; i++) {
+		for (j = 0; j < MALLOC_BENCHMARK_BATCH; j++)
+			batch[j] = malloc(16 + j % 16 * 16);
+		for (j = 0; j < MALLOC_BENCHMARK_BATCH; j++)
+			free(batch[j]);
+	}
+	batched = read_tsc() - start;
+
+	printf("Malloc throughput: %llu cycles per pair back to back, %llu cycles per pair batched\n",
+		(unsigned long long) (pairs / (MALLOC_BENCHMARK_ROUNDS * 16)),
+		(unsigned long long) (batched / (MALLOC_BENCHMARK_ROUNDS / 16 * MALLOC_BENCHMARK_BATCH)));
+}
+
+struct latency {
+	uint64_t worst_allocate;
+	uint64_t worst_free;
+	uint64_t total_allocate;
+	uint64_t total_free;
+	size_t allocations;
+	size_t frees;
+};
+
+/* Frees or allocates a random slot, LATENCY_BENCHMARK_ROUNDS times, with */
+/* sizes of up to 2 KiB, and records the cycles of every operation. */
+static void _time_latency(struct latency *latency, void *context,
+		void *(*allocate)(void *context, size_t size), void (*release)(void *context, void *ptr)) {
+	void *slots[LATENCY_BENCHMARK_SLOTS];
+	uint64_t state, start, cycles;
+	size_t i, j;
+
+	for (j = 0; j < LATENCY_BENCHMARK_SLOTS; j++)
+		slots[j] = NULL;
+	latency->worst_allocate = latency->worst_free = 0;
+	latency->total_allocate = latency->total_free = 0;
+	latency->allocations = latency->frees = 0;
+
+	state = UINT64_C(0x2545f4914f6cdd1d);
+	for (i = 0; i < LATENCY_BENCHMARK_ROUNDS; i++) {
+		state = state * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+		j = (state >> 33) % LATENCY_BENCHMARK_SLOTS;
+		if (slots[j]) {
+			start = read_tsc();
+			release(context, slots[j]);
+			cycles = read_tsc() - start;
+			slots[j] = NULL;
+			latency->total_free += cycles;
+			latency->frees++;
+			if (cycles > latency->worst_free)
+				latency->worst_free = cycles;
+			continue;
+		}
+
+		start = read_tsc();
+		slots[j] = allocate(context, 16 + (state >> 48) % 2048);
+		cycles = read_tsc() - start;
+		latency->total_allocate += cycles;
+		latency->allocations++;
+		if (cycles > latency->worst_allocate)
+			latency->worst_allocate = cycles;
+	}
+
+	for (j = 0; j < LATENCY_BENCHMARK_SLOTS; j++)
+		if (slots[j])
+			release(context, slots[j]);
+}
+
+static void *_tlsf_allocate(void *pool, size_t size) {
+	return tlsf_allocate(pool, size);
+}
+
+static void _tlsf_free(void *pool, void *ptr) {
+	tlsf_free(pool, ptr);
+}
+
+static void *_malloc(void *context, size_t size) {
+	(void) context;
+	return malloc(size);
+}
+
+static void _free(void *context, void *ptr) {
+	(void) context;
+	free(ptr);
+}
+
+static void _print_latency(const char *name, struct latency *latency) {
+	printf("Allocation latency, %s: worst %llu cycles allocating, %llu freeing, mean %llu and %llu\n",
+		name, (unsigned long long) latency->worst_allocate, (unsigned long long) latency->worst_free,
+		(unsigned long long) (latency->total_allocate / (latency->allocations ? latency->allocations : 1)),
+		(unsigned long long) (latency->total_free / (latency->frees ? latency->frees : 1)));
+}
+
+/* The worst case is what interrupt context has to budget for. A TLSF */
+/* pool bounds it, where malloc() may walk its chain or claim memory. */
+static void _benchmark_allocation_latency(void) {
+	struct tlsf_pool *pool;
+	struct latency latency;
+
+	pool = create_tlsf_pool(LATENCY_BENCHMARK_POOL);
+	if (!pool) {
+		printf("Allocation latency: could not create the pool\n");
+		return;
+	}
+	_time_latency(&latency, pool, _tlsf_allocate, _tlsf_free);
+	destroy_tlsf_pool(pool);
+	_print_latency("tlsf pool", &latency);
+
+	_time_latency(&latency, NULL, _malloc, _free);
+	_print_latency("malloc", &latency);
+}
+
+void run_memory_benchmarks(void) {
+	_benchmark_cache_coloring();
+	_benchmark_malloc_throughput();
+	_benchmark_allocation_latency();
+}
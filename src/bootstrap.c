@@ -438,6 +438,28 @@ void load_init_executable(void) {
 	bootstrap_info.init.data = buffer;
 }
 
+/* Prefers the ACPI 2.0 RSDP, which has the 64 bit XSDT address. */
+static void find_acpi_rsdp(void) {
+	EFI_GUID acpi2_guid = EFI_ACPI_20_TABLE_GUID;
+	EFI_GUID acpi1_guid = ACPI_TABLE_GUID;
+	EFI_CONFIGURATION_TABLE *table;
+	UINTN i;
+
+	bootstrap_info.acpi.rsdp = 0;
+	for (i = 0; i < system_table->NumberOfTableEntries; i++) {
+		table = &system_table->ConfigurationTable[i];
+		if (memcmp(&table->VendorGuid, &acpi2_guid, sizeof(EFI_GUID)) == 0) {
+			bootstrap_info.acpi.rsdp = (uint64_t) table->VendorTable;
+			return;
+		}
+		if (memcmp(&table->VendorGuid, &acpi1_guid, sizeof(EFI_GUID)) == 0)
+			bootstrap_info.acpi.rsdp = (uint64_t) table->VendorTable;
+	}
+
+	if (!bootstrap_info.acpi.rsdp)
+		uefi_print(L"No ACPI tables found\r\n");
+}
+
 void bootstrap_entry(EFI_HANDLE handle, EFI_SYSTEM_TABLE *st) {
 	struct memory_map *memmap;
 	uint64_t transition_pages;
@@ -454,6 +476,7 @@ void bootstrap_entry(EFI_HANDLE handle, EFI_SYSTEM_TABLE *st) {
 	uefi_print(L"Detecting Memory...\r\n");
 
 	load_init_executable();
+	find_acpi_rsdp();
 
 	transition_pages = allocate_transition_pages();
 	bootstrap_info.memory.stack = allocate_bootstrap_stack();
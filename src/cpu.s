@@ -44,6 +44,21 @@ flush_page:
 	invlpg (%rcx)
 	ret
 
+.global zero_page_nontemporal
+zero_page_nontemporal:
+	xorl %eax, %eax
+	movl $128, %edx
+1:
+	movnti %rax, (%rcx)
+	movnti %rax, 8(%rcx)
+	movnti %rax, 16(%rcx)
+	movnti %rax, 24(%rcx)
+	addq $32, %rcx
+	decl %edx
+	jnz 1b
+	sfence
+	ret
+
 .extern __kernel_start
 .equ PHYSICAL_PAGE_MAP_BASE, 0xffff800000000000
 .global return_to_high_kernel
@@ -104,3 +119,16 @@ read_msr:
 	movl %eax, (%rsp)
 	popq %rax
 	ret
+
+.global current_cpu_index
+current_cpu_index:
+	xorl %eax, %eax
+	ret
+
+.global read_tsc
+read_tsc:
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	ret
@@ -5,6 +5,7 @@
 #include "terminal.h"
 #include "memory.h"
 #include "cpu.h"
+#include "benchmark.h"
 
 void print_video_info(void) {
 	printf("Framebuffer: %u x %u - %s\n",
@@ -52,6 +53,28 @@ void print_memory_info(void) {
 		freebytes, usablebytes, bytes);
 }
 
+void print_physical_memory_stats(void) {
+	struct physical_memory_stats stats;
+	unsigned order;
+
+	get_physical_memory_stats(&stats);
+	printf("Physical memory: 0x%zx free / 0x%zx usable, 0x%zx cached, 0x%zx deferred\n",
+		stats.free_pages * PAGESIZE, stats.total_pages * PAGESIZE,
+		stats.cached_pages * PAGESIZE, stats.deferred_pages * PAGESIZE);
+	printf("Free blocks: %zu, largest 0x%zx, fragmentation %u/1000\n",
+		stats.free_blocks, stats.largest_free_block * PAGESIZE, stats.fragmentation_index);
+
+	printf("Free blocks by order:");
+	for (order = 0; order < PHYS_ORDER_COUNT; order++)
+		if (stats.free_blocks_by_order[order])
+			printf(" %u:%zu", order, stats.free_blocks_by_order[order]);
+	printf("\n");
+
+	printf("Allocations: %zu (%zu pages), frees: %zu (%zu pages), failures: %zu\n",
+		stats.allocations, stats.pages_allocated, stats.frees, stats.pages_freed,
+		stats.failures);
+}
+
 void enable_cpu_features(void) {
 	struct cpuid_result cpuid_res;
 	uint32_t max_ext_cpuid;
@@ -89,15 +112,24 @@ void kentry(void) {
 	initalize_memory();
 	return_to_high_kernel();
 	printf("Memory intialized\n");
+	printf("Deferred 0x%zx bytes of memory initialization\n", deferred_physical_pages() * PAGESIZE);
 
 	initalize_gdt();
 	printf("GDT Initalized\n");
 	unmap_lower_memory();
+	printf("Reclaimed 0x%zx bytes of boot memory\n", reclaim_boot_memory() * PAGESIZE);
+	print_physical_memory_stats();
 
 	initalize_idt();
 	printf("IDT Initalized\n");
 
 	initalize_syscall();
 	printf("Syscall initalized\n");
-	for (;;);
+
+#ifdef MEMORY_BENCHMARKS
+	run_memory_benchmarks();
+#endif
+	for (;;)
+		if (!initalize_deferred_memory() && !trim_idle_heap())
+			refill_zeroed_pages();
 }
@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "memory.h"
+
+/* A dma pool hands out fixed size buffers carved from pages allocated */
+/* below the pool's address limit, so drivers allocating many small */
+/* descriptors do not each split a block of the page allocator. Device */
+/* accesses are cache coherent on x86, so the buffers are used through */
+/* the ordinary write-back high physical map. Chunks are only returned */
+/* to the page allocator when the pool is destroyed. Pools and chunk */
+/* records come from slab caches, created with the first pool. */
+struct dma_chunk {
+	struct dma_chunk *next;
+	uint64_t base;
+};
+
+struct dma_pool {
+	size_t size;
+	size_t chunk_pages;
+	unsigned flags;
+	struct dma_chunk *chunks;
+	void *free; /* each free buffer starts with the next free buffer */
+};
+
+static struct slab_cache *pool_cache, *chunk_cache;
+
+struct dma_pool *create_dma_pool(size_t size, size_t align, unsigned flags) {
+	struct dma_pool *pool;
+
+	if (!size || !align || align & (align - 1) || align > PAGESIZE)
+		return NULL;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = (size + align - 1) & ~(align - 1);
+
+	if (!pool_cache)
+		pool_cache = create_slab_cache(sizeof(struct dma_pool), sizeof(void *), NULL);
+	if (!chunk_cache)
+		chunk_cache = create_slab_cache(sizeof(struct dma_chunk), sizeof(void *), NULL);
+	if (!pool_cache || !chunk_cache)
+		return NULL;
+
+	pool = slab_allocate(pool_cache);
+	if (!pool)
+		return NULL;
+
+	pool->size = size;
+	pool->chunk_pages = (size + PAGESIZE - 1) / PAGESIZE;
+	pool->flags = flags & PHYS_PAGE_ALLOC_DMA_4G;
+	pool->chunks = NULL;
+	pool->free = NULL;
+	return pool;
+}
+
+/* Carves a new chunk into buffers, none of which crosses a page */
+/* boundary unless it is larger than a page. */
+static int _grow_pool(struct dma_pool *pool) {
+	struct dma_chunk *chunk;
+	uint8_t *base;
+	size_t offset;
+
+	chunk = slab_allocate(chunk_cache);
+	if (!chunk)
+		return 1;
+
+	if (allocate_physical_pages(&chunk->base, pool->chunk_pages,
+			PHYS_PAGE_ALLOC_CONSECUTIVE | pool->flags)) {
+		slab_free(chunk_cache, chunk);
+		return 1;
+	}
+
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+
+	base = physical_to_virtual(chunk->base);
+	for (offset = 0; offset + pool->size <= pool->chunk_pages * PAGESIZE; offset += pool->size) {
+		*(void **) (base + offset) = pool->free;
+		pool->free = base + offset;
+	}
+	return 0;
+}
+
+void *dma_pool_allocate(struct dma_pool *pool, uint64_t *paddr) {
+	void *buffer;
+
+	if (!pool->free && _grow_pool(pool))
+		return NULL;
+
+	buffer = pool->free;
+	pool->free = *(void **) buffer;
+	*paddr = (uint64_t) buffer - PHYSICAL_PAGE_MAP_BASE;
+	return buffer;
+}
+
+void dma_pool_free(struct dma_pool *pool, void *buffer) {
+	*(void **) buffer = pool->free;
+	pool->free = buffer;
+}
+
+void destroy_dma_pool(struct dma_pool *pool) {
+	struct dma_chunk *chunk;
+
+	while (pool->chunks) {
+		chunk = pool->chunks;
+		pool->chunks = chunk->next;
+		free_consecutive_physical_pages(chunk->base, pool->chunk_pages);
+		slab_free(chunk_cache, chunk);
+	}
+	slab_free(pool_cache, pool);
+}
@@ -3,13 +3,34 @@
 #include "memory.h"
 #include "terminal.h"
 #include "cpu.h"
+#include "util.h"
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 #define MALLOC_MAGIC_USED UINT64_C(0x6465737564657375)
+#define MALLOC_MAGIC_CACHED UINT64_C(0x6863616368636163) /* in a magazine */
 
 #define DEFAULT_ALIGNMENT 8
 
+/* Every block is a multiple of MALLOC_GRANULE bytes, and at least large */
+/* enough to hold a free region once it is freed. */
+#define MALLOC_GRANULE 16
+#define MIN_REGION_SIZE 32
+
+/* Blocks are boundary tagged. Every block starts with its size, whose */
+/* low bits hold the flags below, and a free block also ends with a copy */
+/* of its size. Freeing a block finds both of its neighbours from its own */
+/* address, and merges with the free ones without searching for them. */
+#define MALLOC_IN_USE 1
+#define MALLOC_PREV_FREE 2 /* the block before this one is free */
+#define MALLOC_LARGE 4 /* has pages of its own, see _allocate_large() */
+#define MALLOC_RUN_START 8 /* first block of a run of heap pages */
+#define MALLOC_FLAGS (MALLOC_GRANULE - 1)
+
+#define BLOCK_SIZE(block) ((block)->size & ~(size_t) MALLOC_FLAGS)
+#define NEXT_BLOCK(block) ((struct malloc_tag *) ((uint8_t *) (block) + BLOCK_SIZE(block)))
+
 struct malloc_free_region {
 	size_t size; /* includes this tag */
 	struct malloc_free_region *next;
@@ -17,195 +38,940 @@ struct malloc_free_region {
 };
 
 struct malloc_tag {
-	uint64_t magic;
 	size_t size;
+	uint64_t magic;
 };
 
+/* Each run of heap pages ends in a fence, a block that is always in use, */
+/* so merging never runs off the end of a run. */
+#define FENCE_SIZE sizeof(struct malloc_tag)
 
+/* Free regions, in no particular order. */
 struct malloc_free_region *kernel_allocation_chain;
+static size_t chain_free_bytes;
+
+/* Whole free pages of kernel_allocation_chain go back to the page */
+/* allocators when the kernel is idle, once more than TRIM_HIGH bytes of */
+/* it are free, and then until no more than TRIM_LOW are, so a heap that */
+/* hovers around one size does not unmap and claim the same pages over */
+/* and over. The walk is not bounded, so free() never trims. Only spans of */
+/* at least TRIM_MIN_PAGES are cut out, so runs do not splinter. What a */
+/* trim could not return raises the mark for the next one, until the */
+/* heap grows again. */
+#define TRIM_HIGH (256 * PAGESIZE)
+#define TRIM_LOW (64 * PAGESIZE)
+#define TRIM_MIN_PAGES 4
+
+static size_t trim_threshold;
+
+/* The heap grows by at least claim_chunk bytes at a time. It starts at */
+/* CLAIM_CHUNK_MIN and doubles with every claim up to CLAIM_CHUNK_MAX, so */
+/* a growing heap claims memory rarely, and a trim that gives memory back */
+/* halves it again. Claims of LARGE_PAGESIZE or more are whole, aligned */
+/* 2 MiB pages of address space, so they can be backed by large pages. */
+#define CLAIM_CHUNK_MIN (64 * PAGESIZE)
+#define CLAIM_CHUNK_MAX (16 * LARGE_PAGESIZE)
+
+static size_t claim_chunk;
+
+/* Small blocks are kept out of kernel_allocation_chain on segregated */
+/* free lists, one per size class of MALLOC_GRANULE bytes up to */
+/* SMALL_MAX_SIZE. A bitmap of the non-empty classes finds the smallest */
+/* class that fits without looking at the empty ones, so both allocating */
+/* and freeing a small block are constant time. Blocks on the class lists */
+/* stay tagged as in use, so they do not coalesce until they are merged */
+/* back into the chain before the heap is grown. */
+#define SMALL_CLASS_COUNT 32
+#define SMALL_MAX_SIZE (SMALL_CLASS_COUNT * MALLOC_GRANULE)
+
+static struct malloc_free_region *small_classes[SMALL_CLASS_COUNT];
+static uint32_t small_class_map;
+
+/* In front of the class lists, each cpu keeps a loaded and a previous */
+/* magazine of freed blocks per class, and most malloc() and free() pairs */
+/* only push and pop the loaded one. Blocks in magazines stay tagged as */
+/* used. When both magazines of a class are full or empty, one is swapped */
+/* with the shared depot, a magazine at a time, so the depot and the */
+/* class lists behind it are only touched once per MAGAZINE_SIZE */
+/* operations. The depot is where cross-cpu locking would go. */
+#define MAGAZINE_SIZE 14
+#define DEPOT_MAX_FULL 8
+
+struct malloc_magazine {
+	struct malloc_magazine *next;
+	size_t rounds;
+	void *objects[MAGAZINE_SIZE];
+};
+
+struct malloc_cpu {
+	struct malloc_magazine *loaded[SMALL_CLASS_COUNT];
+	struct malloc_magazine *previous[SMALL_CLASS_COUNT];
+};
+
+struct magazine_depot {
+	struct malloc_magazine *full;
+	struct malloc_magazine *empty;
+	size_t full_count;
+};
+
+static struct malloc_cpu malloc_cpus[MAX_CPU_COUNT];
+static struct magazine_depot depots[SMALL_CLASS_COUNT];
+static struct slab_cache *magazine_cache;
+
+/* kernel_allocation_chain empties whenever all of its space is handed */
+/* out, so it cannot double as the initalization check. */
+static int malloc_initalized;
+
+/* claim_new_memory() starts its pages with frames from the zeroed page */
+/* pool, as far as the pool goes, and nothing else is cleared. Everything */
+/* in [fresh_base, fresh_end) is such memory that has not been written */
+/* since, so calloc() does not clear the part of an allocation inside it. Blocks are carved from the front of */
+/* a region, so the span mostly shrinks from below. The chain allocations */
+/* record the fresh part of the block they hand out in [zero_skip_base, */
+/* zero_skip_end). */
+static uint64_t fresh_base, fresh_end;
+static uint64_t zero_skip_base, zero_skip_end;
+
+/* Records that the heap, or the owner of a block, wrote to [start, end). */
+static void _dirty_fresh(uint64_t start, uint64_t end) {
+	if (end <= fresh_base || start >= fresh_end)
+		return;
+	if (start > fresh_base && end >= fresh_end)
+		fresh_end = start;
+	else
+		fresh_base = end;
+}
+
+static size_t *_footer(struct malloc_free_region *region) {
+	return (size_t *) NEXT_BLOCK(region) - 1;
+}
+
+static void _link_region(struct malloc_free_region *region) {
+	chain_free_bytes += BLOCK_SIZE(region);
+	region->prev = NULL;
+	region->next = kernel_allocation_chain;
+	if (region->next)
+		region->next->prev = region;
+	kernel_allocation_chain = region;
+}
+
+static void _unlink_region(struct malloc_free_region *region) {
+	chain_free_bytes -= BLOCK_SIZE(region);
+	if (region->next)
+		region->next->prev = region->prev;
+	if (region->prev)
+		region->prev->next = region->next;
+	else
+		kernel_allocation_chain = region->next;
+}
+
+/* Turns [region, region + size) into a free region on the chain. The */
+/* block before it must not be free. size may carry MALLOC_RUN_START. */
+static void _make_free(struct malloc_free_region *region, size_t size) {
+	region->size = size;
+	*_footer(region) = BLOCK_SIZE(region);
+	NEXT_BLOCK(region)->size |= MALLOC_PREV_FREE;
+	_dirty_fresh((uint64_t) region, (uint64_t) region + sizeof(struct malloc_free_region));
+	_dirty_fresh((uint64_t) _footer(region), (uint64_t) NEXT_BLOCK(region));
+	_link_region(region);
+}
+
+/* Sets up [base, base + size) as a run of heap memory, one free region */
+/* and a fence. */
+static void _add_run(uint64_t base, size_t size) {
+	struct malloc_tag *fence;
+
+	fence = (struct malloc_tag *) (base + size - FENCE_SIZE);
+	fence->size = FENCE_SIZE | MALLOC_IN_USE;
+	fence->magic = MALLOC_MAGIC_USED;
+	_make_free((struct malloc_free_region *) base, (size - FENCE_SIZE) | MALLOC_RUN_START);
+}
 
 void initalize_malloc(void) {
-	if (kernel_allocation_chain)
+	if (malloc_initalized)
 		panic("initalize_malloc(): can only be called once");
 
-	kernel_allocation_chain = (struct malloc_free_region *) KERNEL_HEAP_BOTTOM;
-	kernel_allocation_chain->size = PAGESIZE;
-	kernel_allocation_chain->next = NULL;
-	kernel_allocation_chain->prev = NULL;
+	_add_run(KERNEL_HEAP_BOTTOM, PAGESIZE);
+	trim_threshold = TRIM_HIGH;
+	claim_chunk = CLAIM_CHUNK_MIN;
+	malloc_initalized = 1;
 }
 
-void *allocate_entire_region(struct malloc_free_region **region) {
-	size_t size;
+/* Hands out allocsize bytes at start, which lies in the free region, and */
+/* leaves the space on either side of it free. */
+static void *_carve(struct malloc_free_region *region, uint64_t start, size_t allocsize) {
 	struct malloc_tag *alloc;
-	struct malloc_free_region *hanger;
+	uint64_t base, end;
+	size_t flags, run;
+
+	base = (uint64_t) region;
+	end = base + BLOCK_SIZE(region);
+	run = region->size & MALLOC_RUN_START;
+	flags = MALLOC_IN_USE;
+	if (end - (start + allocsize) < MIN_REGION_SIZE)
+		allocsize = end - start;
+
+	zero_skip_base = MAX(start + sizeof(struct malloc_tag), fresh_base);
+	zero_skip_end = MIN(start + allocsize, fresh_end);
+
+	_unlink_region(region);
+	if (start != base) {
+		_make_free(region, (start - base) | run);
+		flags |= MALLOC_PREV_FREE;
+	} else {
+		flags |= run;
+	}
+	if (start + allocsize != end)
+		_make_free((struct malloc_free_region *) (start + allocsize), end - start - allocsize);
+	_dirty_fresh(start, start + allocsize);
+
+	alloc = (struct malloc_tag *) start;
+	alloc->size = allocsize | flags;
+	alloc->magic = MALLOC_MAGIC_USED;
+	NEXT_BLOCK(alloc)->size &= ~(size_t) MALLOC_PREV_FREE;
+	return alloc + 1;
+}
 
-	hanger = *region;
-	size = hanger->size;
+/* Returns a block to the chain, merging it with free neighbours. */
+static void _release_block(struct malloc_tag *tag) {
+	struct malloc_free_region *region, *neighbour;
+	size_t size;
 
-	*region = hanger->next;
-	if (hanger->next)
-		hanger->next->prev = hanger->prev;
+	/* a block merged into the region before it keeps no tag of its own, */
+	/* so this is what makes freeing it again fail the magic check */
+	tag->size &= ~(size_t) MALLOC_IN_USE;
+	tag->magic = 0;
 
-	alloc = (struct malloc_tag *) hanger;
-	alloc->magic = MALLOC_MAGIC_USED;
-	alloc->size = size;
+	region = (struct malloc_free_region *) tag;
+	size = BLOCK_SIZE(tag);
 
-	return alloc + 1;
+	neighbour = (struct malloc_free_region *) NEXT_BLOCK(tag);
+	if (!(neighbour->size & MALLOC_IN_USE)) {
+		_unlink_region(neighbour);
+		size += BLOCK_SIZE(neighbour);
+	}
+
+	if (tag->size & MALLOC_PREV_FREE) {
+		neighbour = (struct malloc_free_region *) ((uint8_t *) tag - *((size_t *) tag - 1));
+		if (neighbour->size & MALLOC_IN_USE || NEXT_BLOCK(neighbour) != tag)
+			panic("_release_block(): block %p follows a corrupt free region %p", tag, neighbour);
+		_unlink_region(neighbour);
+		size += BLOCK_SIZE(neighbour);
+		region = neighbour;
+	}
+
+	_make_free(region, size | (region->size & MALLOC_RUN_START));
+}
+
+static unsigned _small_class(size_t size) {
+	return size / MALLOC_GRANULE - 1;
 }
 
-void *allocate_partial_region(struct malloc_free_region **region, size_t allocsize) {
+/* The class lists are only ever used from the head, so they are singly */
+/* linked. */
+static void _push_small(struct malloc_free_region *region) {
+	unsigned class;
+
+	class = _small_class(BLOCK_SIZE(region));
+	region->next = small_classes[class];
+	region->prev = NULL;
+	small_classes[class] = region;
+	small_class_map |= UINT32_C(1) << class;
+}
+
+static struct malloc_free_region *_pop_small(unsigned class) {
+	struct malloc_free_region *region;
+
+	region = small_classes[class];
+	small_classes[class] = region->next;
+	if (!small_classes[class])
+		small_class_map &= ~(UINT32_C(1) << class);
+	return region;
+}
+
+/* Takes the smallest small block of at least allocsize bytes, splitting */
+/* off what is left if it can hold a block of its own. */
+static void *_allocate_small(size_t allocsize) {
+	struct malloc_free_region *region, *rest;
 	struct malloc_tag *alloc;
-	struct malloc_free_region *next, *prev;
-	size_t size;
+	uint32_t map;
+
+	map = small_class_map & ~((UINT32_C(1) << _small_class(allocsize)) - 1);
+	if (!map)
+		return NULL;
 
-	next = (*region)->next;
-	prev = (*region)->prev;
-	size = (*region)->size;
+	region = _pop_small(__builtin_ctz(map));
+	if (BLOCK_SIZE(region) - allocsize >= MIN_REGION_SIZE) {
+		rest = (struct malloc_free_region *) ((uint8_t *) region + allocsize);
+		rest->size = (BLOCK_SIZE(region) - allocsize) | MALLOC_IN_USE;
+		_push_small(rest);
+	} else {
+		allocsize = BLOCK_SIZE(region);
+	}
 
-	alloc = (struct malloc_tag *) *region;
+	alloc = (struct malloc_tag *) region;
+	alloc->size = allocsize | (region->size & MALLOC_FLAGS);
 	alloc->magic = MALLOC_MAGIC_USED;
-	alloc->size = allocsize;
+	return alloc + 1;
+}
 
-	*region = (struct malloc_free_region *) ((uint8_t *) *region + allocsize);
-	(*region)->next = next;
-	(*region)->prev = prev;
-	(*region)->size = size - allocsize;
-	if (next)
-		next->prev = *region;
-	if (prev)
-		prev->next = *region;
+/* Moves the blocks of a magazine, which are still tagged as used, onto */
+/* the class lists. */
+static void _drain_magazine(struct malloc_magazine *magazine) {
+	while (magazine->rounds)
+		_push_small((struct malloc_free_region *)
+			((struct malloc_tag *) magazine->objects[--magazine->rounds] - 1));
+}
 
-	return alloc + 1;
+/* Drains the oldest full magazine of a depot that holds too many. */
+static void _trim_depot(struct magazine_depot *depot) {
+	struct malloc_magazine **magazine;
+
+	for (magazine = &depot->full; (*magazine)->next; magazine = &(*magazine)->next)
+		;
+	_drain_magazine(*magazine);
+	(*magazine)->next = depot->empty;
+	depot->empty = *magazine;
+	*magazine = NULL;
+	depot->full_count--;
 }
 
-/* ensures region and region->next do not overlap, panicing if they do, and */
-/* then merges them if they are consecutive. */
-void check_and_merge_regions(struct malloc_free_region *region) {
-	size_t diff;
+/* Returns every block on the class lists, in the full magazines of the */
+/* depot and in this cpu's magazines to kernel_allocation_chain, where */
+/* neighbouring free space coalesces. Magazines of other cpus are left to */
+/* them. */
+static int _flush_small_classes(void) {
+	struct malloc_cpu *cpu;
+	struct magazine_depot *depot;
+	unsigned class;
+
+	cpu = &malloc_cpus[current_cpu_index()];
+	for (class = 0; class < SMALL_CLASS_COUNT; class++) {
+		depot = &depots[class];
+		while (depot->full)
+			_trim_depot(depot);
+		if (cpu->loaded[class])
+			_drain_magazine(cpu->loaded[class]);
+		if (cpu->previous[class])
+			_drain_magazine(cpu->previous[class]);
+	}
 
-	if (!region->next)
-		return;
-	
-	diff = (size_t) region->next - (size_t) region;
-	if (diff < region->size) {
-		/* overlap, panic */
-		panic("check_and_merge_regions(): region %p (size %zu)"
-			" overlaps with region %p (size %zu)",
-			region, region->size, region->next, region->next->size);
-	} else if (diff == region->size) {
-		/* merge */
-		region->size += region->next->size;
-		region->next->next->prev = region;
-		region->next = region->next->next;
-	}
-}
-
-void insert_free_region(struct malloc_free_region *region) {
-	struct malloc_free_region **entry, *prev = NULL;
-	region->next = region->prev = NULL;
-
-	for (entry = &kernel_allocation_chain; *entry != NULL; prev = *entry, entry = &(*entry)->next) {
-		if (*entry > region)
-			break;
+	if (!small_class_map)
+		return 0;
+
+	for (class = 0; class < SMALL_CLASS_COUNT; class++)
+		while (small_classes[class])
+			_release_block((struct malloc_tag *) _pop_small(class));
+	return 1;
+}
+
+/* Pops a block of the class from this cpu's magazines, exchanging an */
+/* empty magazine for a full one from the depot if both are empty. */
+static void *_magazine_allocate(unsigned class) {
+	struct malloc_cpu *cpu;
+	struct magazine_depot *depot;
+	struct malloc_magazine *magazine;
+	void *ptr;
+
+	cpu = &malloc_cpus[current_cpu_index()];
+	magazine = cpu->loaded[class];
+	if (!magazine || !magazine->rounds) {
+		if (cpu->previous[class] && cpu->previous[class]->rounds) {
+			cpu->loaded[class] = cpu->previous[class];
+			cpu->previous[class] = magazine;
+		} else {
+			depot = &depots[class];
+			if (!depot->full)
+				return NULL;
+			if (cpu->previous[class]) {
+				cpu->previous[class]->next = depot->empty;
+				depot->empty = cpu->previous[class];
+			}
+			cpu->previous[class] = magazine;
+			cpu->loaded[class] = depot->full;
+			depot->full = depot->full->next;
+			depot->full_count--;
+		}
+		magazine = cpu->loaded[class];
 	}
 
-	region->next = *entry;
-	region->prev = prev;
-	*entry = region;
+	ptr = magazine->objects[--magazine->rounds];
+	((struct malloc_tag *) ptr - 1)->magic = MALLOC_MAGIC_USED;
+	return ptr;
+}
 
-	if (region->next) {
-		region->next->prev = region;
-		check_and_merge_regions(region);
+/* Pushes a freed block onto this cpu's magazines, exchanging a full */
+/* magazine for an empty one from the depot if both are full. Returns 1 */
+/* if the block could not be taken. */
+static int _magazine_free(unsigned class, void *ptr) {
+	struct malloc_cpu *cpu;
+	struct magazine_depot *depot;
+	struct malloc_magazine *magazine, *empty;
+
+	cpu = &malloc_cpus[current_cpu_index()];
+	magazine = cpu->loaded[class];
+	if (!magazine || magazine->rounds == MAGAZINE_SIZE) {
+		if (cpu->previous[class] && cpu->previous[class]->rounds < MAGAZINE_SIZE) {
+			cpu->loaded[class] = cpu->previous[class];
+			cpu->previous[class] = magazine;
+		} else {
+			depot = &depots[class];
+			empty = depot->empty;
+			if (empty) {
+				depot->empty = empty->next;
+			} else {
+				if (!magazine_cache)
+					magazine_cache = create_slab_cache(sizeof(struct malloc_magazine), 0, NULL);
+				if (!magazine_cache)
+					return 1;
+				empty = slab_allocate(magazine_cache);
+				if (!empty)
+					return 1;
+			}
+			empty->rounds = 0;
+
+			/* the previous magazine, if any, is full */
+			if (cpu->previous[class]) {
+				cpu->previous[class]->next = depot->full;
+				depot->full = cpu->previous[class];
+				depot->full_count++;
+				if (depot->full_count > DEPOT_MAX_FULL)
+					_trim_depot(depot);
+			}
+			cpu->previous[class] = magazine;
+			cpu->loaded[class] = empty;
+		}
+		magazine = cpu->loaded[class];
+	}
+
+	/* a block in a magazine is not in use, so freeing it again is caught */
+	((struct malloc_tag *) ptr - 1)->magic = MALLOC_MAGIC_CACHED;
+	magazine->objects[magazine->rounds++] = ptr;
+	return 0;
+}
+
+/* The heap only needs to be virtually contiguous, so new memory is backed */
+/* by up to this many runs of physical pages. */
+#define CLAIM_EXTENT_COUNT 16
+
+#define HEAP_PAGE_FLAGS (PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE)
+#define LARGE_PAGE_COUNT (LARGE_PAGESIZE / PAGESIZE)
+
+/* Maps count pages at vaddr to newly allocated frames. With zeroed, the */
+/* first pages get frames the zeroed page pool cleared ahead of time, as */
+/* many as it holds, and their number is stored in *zeroed. The rest are */
+/* mapped in runs of consecutive frames. */
+static int _map_small_pages(uint64_t vaddr, size_t count, size_t *zeroed) {
+	size_t n, i, done;
+	uint64_t frame;
+	struct physical_extent extents[CLAIM_EXTENT_COUNT];
+
+	done = 0;
+	if (zeroed) {
+		for (; done < count && zeroed_physical_pages(); done++) {
+			if (allocate_physical_pages(&frame, 1, PHYS_PAGE_ALLOC_ZERO))
+				break;
+			set_physical_page_owner(frame, 1, PAGE_OWNER_HEAP);
+			map_pages(vaddr + done * PAGESIZE, frame, 1, HEAP_PAGE_FLAGS);
+		}
+		*zeroed = done;
+	}
+	if (done == count)
+		return 0;
+
+	n = allocate_physical_extents(extents, CLAIM_EXTENT_COUNT, count - done);
+	if (!n) {
+		unmap_pages(vaddr, done, free_consecutive_physical_pages);
+		return 1;
 	}
 
-	if (region->prev) {
-		region->prev->next = region;
-		check_and_merge_regions(region->prev);
+	vaddr += done * PAGESIZE;
+	for (i = 0; i < n; i++) {
+		set_physical_page_owner(extents[i].base, extents[i].count, PAGE_OWNER_HEAP);
+		map_pages(vaddr, extents[i].base, extents[i].count, HEAP_PAGE_FLAGS);
+		vaddr += extents[i].count * PAGESIZE;
 	}
+	return 0;
 }
 
-int claim_new_memory(size_t sz) {
-	size_t count;
-	uint64_t vaddr, frame, offset;
-	struct malloc_free_region *region;
+/* Maps the 2 MiB page at vaddr to a frame of its own. Compaction only */
+/* moves 4 KiB heap pages, so the frames are owned by the kernel, and */
+/* stay so if a trim splits the page. */
+static int _map_large_page(uint64_t vaddr) {
+	uint64_t frame;
+
+	if (allocate_physical_pages(&frame, LARGE_PAGE_COUNT, PHYS_PAGE_ALLOC_CONSECUTIVE | PHYS_PAGE_ALLOC_2M))
+		return 1;
+	set_physical_page_owner(frame, LARGE_PAGE_COUNT, PAGE_OWNER_KERNEL);
+	map_pages(vaddr, frame, LARGE_PAGE_COUNT, HEAP_PAGE_FLAGS | PAGE_LARGE);
+	return 0;
+}
+
+/* Maps count pages at vaddr to newly allocated frames. The aligned 2 MiB */
+/* of the range are mapped by large pages while there are frames for */
+/* them, and the rest by 4 KiB pages. The number of pages at vaddr that */
+/* are known to be zero is stored in *zeroed. */
+static int _map_fresh_pages(uint64_t vaddr, size_t count, size_t *zeroed) {
+	uint64_t end, low, high, mid;
+
+	end = vaddr + count * PAGESIZE;
+	low = (vaddr + LARGE_PAGESIZE - 1) & ~(uint64_t) (LARGE_PAGESIZE - 1);
+	high = end & ~(uint64_t) (LARGE_PAGESIZE - 1);
+	if (high <= low)
+		return _map_small_pages(vaddr, count, zeroed);
+
+	for (mid = low; mid < high; mid += LARGE_PAGESIZE) {
+		if (_map_large_page(mid))
+			break;
+	}
 
-	count = (sz + PAGESIZE - 1) / PAGESIZE; 
-	vaddr = allocate_virtual_pages(count);
+	if (_map_small_pages(vaddr, (low - vaddr) / PAGESIZE, zeroed))
+		goto fail;
+	if (_map_small_pages(mid, (end - mid) / PAGESIZE, NULL)) {
+		unmap_pages(vaddr, (low - vaddr) / PAGESIZE, free_consecutive_physical_pages);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	unmap_pages(low, (mid - low) / PAGESIZE, free_consecutive_physical_pages);
+	return 1;
+}
+
+/* Returns count pages of address space, aligned to a 2 MiB page if they */
+/* span one, mapped to new frames, or 0. The number of pages at the start */
+/* that are known to be zero is stored in *zeroed. */
+static uint64_t _claim_pages(size_t count, size_t *zeroed) {
+	uint64_t vaddr, base;
+	size_t slack;
+
+	slack = count >= LARGE_PAGE_COUNT ? LARGE_PAGE_COUNT - 1 : 0;
+	vaddr = allocate_virtual_pages(count + slack);
 	if (!vaddr)
+		return 0;
+
+	/* give back what aligning did not use */
+	base = (vaddr + slack * PAGESIZE) & ~(uint64_t) (slack ? LARGE_PAGESIZE - 1 : 0);
+	if (base != vaddr)
+		free_virtual_pages(vaddr, (base - vaddr) / PAGESIZE);
+	if (base - vaddr != slack * PAGESIZE)
+		free_virtual_pages(base + count * PAGESIZE, slack - (base - vaddr) / PAGESIZE);
+
+	if (_map_fresh_pages(base, count, zeroed)) {
+		free_virtual_pages(base, count);
+		return 0;
+	}
+	return base;
+}
+
+int claim_new_memory(size_t sz) {
+	size_t count, need, zeroed;
+	uint64_t vaddr;
+
+	if (sz > SIZE_MAX - FENCE_SIZE - PAGESIZE)
 		return 1;
-	if (allocate_physical_pages(&frame, count, PHYS_PAGE_ALLOC_CONSECUTIVE)) {
-		free_virtual_pages(vaddr, count);
+	need = (sz + FENCE_SIZE + PAGESIZE - 1) / PAGESIZE;
+	count = MAX(need, claim_chunk / PAGESIZE);
+	if (count >= LARGE_PAGE_COUNT)
+		count = (count + LARGE_PAGE_COUNT - 1) & ~(size_t) (LARGE_PAGE_COUNT - 1);
+
+	vaddr = _claim_pages(count, &zeroed);
+	if (!vaddr && count > need) {
+		/* a whole chunk is too much, but the request may still fit */
+		count = need;
+		vaddr = _claim_pages(count, &zeroed);
+	}
+	if (!vaddr)
 		return 1;
+
+	claim_chunk = MIN(claim_chunk * 2, CLAIM_CHUNK_MAX);
+	fresh_base = vaddr;
+	fresh_end = MIN(vaddr + zeroed * PAGESIZE, vaddr + count * PAGESIZE - FENCE_SIZE);
+	_add_run(vaddr, count * PAGESIZE);
+	trim_threshold = MAX(TRIM_HIGH, chain_free_bytes + (TRIM_HIGH - TRIM_LOW));
+
+	return 0;
+}
+
+/* Cuts the whole pages out of a free region. What is left in front of */
+/* them becomes a run ending in a new fence, and what is left after them */
+/* a run of its own. A region that starts a run at a page boundary, or */
+/* ends right before the fence of its run, is cut out with no space left */
+/* on that side, and a run that is entirely free goes as a whole, */
+/* whatever its size. Returns the number of bytes cut. */
+static size_t _trim_region(struct malloc_free_region *region) {
+	struct malloc_tag *fence, *next;
+	uint64_t base, end, start, stop;
+	size_t count, run;
+
+	base = (uint64_t) region;
+	end = (uint64_t) NEXT_BLOCK(region);
+	next = (struct malloc_tag *) end;
+	run = region->size & MALLOC_RUN_START;
+
+	/* the seed page is not the virtual allocator's to take back */
+	if (base < KERNEL_HEAP_BOTTOM + PAGESIZE)
+		return 0;
+
+	if (run && !(base % PAGESIZE)) {
+		start = base;
+	} else {
+		start = (base + FENCE_SIZE + PAGESIZE - 1) & ~(uint64_t) (PAGESIZE - 1);
+		if (start - FENCE_SIZE != base && start - FENCE_SIZE - base < MIN_REGION_SIZE)
+			start += PAGESIZE;
 	}
 
-	for (offset = 0; offset < count * PAGESIZE; offset += PAGESIZE) {
-		map_page_autoalloc(vaddr + offset, frame + offset, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE);
-		flush_page(vaddr + offset);
+	if (BLOCK_SIZE(next) == FENCE_SIZE && !((end + FENCE_SIZE) % PAGESIZE)) {
+		stop = end + FENCE_SIZE;
+	} else {
+		stop = end & ~(uint64_t) (PAGESIZE - 1);
+		if (stop != end && end - stop < MIN_REGION_SIZE)
+			stop -= PAGESIZE;
 	}
-	
-	region = (struct malloc_free_region *) vaddr;
-	region->size = count * PAGESIZE;
-	region->next = region->prev = NULL;
 
-	insert_free_region(region);
+	if (stop <= start)
+		return 0;
+	count = (stop - start) / PAGESIZE;
+	if (count < TRIM_MIN_PAGES && (start != base || stop != end + FENCE_SIZE))
+		return 0;
+
+	_unlink_region(region);
+
+	if (start != base) {
+		fence = (struct malloc_tag *) (start - FENCE_SIZE);
+		fence->size = FENCE_SIZE | MALLOC_IN_USE;
+		fence->magic = MALLOC_MAGIC_USED;
+		if ((uint64_t) fence != base)
+			_make_free(region, ((uint64_t) fence - base) | run);
+		else
+			fence->size |= run;
+	}
 
-	return 0;
+	if (stop == end) {
+		next->size = (next->size & ~(size_t) MALLOC_PREV_FREE) | MALLOC_RUN_START;
+	} else if (stop != end + FENCE_SIZE) {
+		_make_free((struct malloc_free_region *) stop, (end - stop) | MALLOC_RUN_START);
+	}
+
+	_dirty_fresh(start, stop);
+	unmap_pages(start, count, free_consecutive_physical_pages);
+	free_virtual_pages(start, count);
+	return stop - start;
+}
+
+static size_t _trim_chain(size_t keep) {
+	struct malloc_free_region *region, *next;
+	size_t trimmed;
+
+	trimmed = 0;
+	for (region = kernel_allocation_chain; region && chain_free_bytes > keep; region = next) {
+		/* the pieces left of a region go to the head, behind the walk */
+		next = region->next;
+		trimmed += _trim_region(region);
+	}
+
+	trim_threshold = MAX(TRIM_HIGH, chain_free_bytes + (TRIM_HIGH - TRIM_LOW));
+	if (trimmed)
+		claim_chunk = MAX(claim_chunk / 2, CLAIM_CHUNK_MIN);
+	return trimmed;
+}
+
+/* Unlike the idle trims, this first returns the cached small blocks to */
+/* the chain, so they do not pin the pages they are in. */
+size_t trim_heap(size_t keep) {
+	_flush_small_classes();
+	return _trim_chain(keep);
+}
+
+int trim_idle_heap(void) {
+	if (chain_free_bytes <= trim_threshold)
+		return 0;
+	return _trim_chain(TRIM_LOW) != 0;
+}
+
+/* Compaction only moves frames the heap owns, so pinned frames are handed */
+/* to the kernel. Freeing a frame resets its owner. */
+void pin_heap_memory(void *ptr, size_t size) {
+	uint64_t vaddr, end, frame;
+
+	end = (uint64_t) ptr + size;
+	for (vaddr = (uint64_t) ptr & PAGEMASK; vaddr < end; vaddr += PAGESIZE) {
+		frame = lookup_frame(vaddr);
+		if (frame)
+			set_physical_page_owner(frame, 1, PAGE_OWNER_KERNEL);
+	}
+}
+
+/* Allocations of LARGE_ALLOCATION_SIZE bytes or more get pages of their */
+/* own, mapped just for them, and go straight back to the page allocators */
+/* when freed, rather than fragmenting kernel_allocation_chain long after */
+/* they are gone. With MALLOC_GUARD_PAGES defined, an unmapped page */
+/* follows each of them, so that running off the end faults. The tag of */
+/* the allocation sits in its first page, and records the size of the */
+/* mapping. */
+#define LARGE_ALLOCATION_SIZE (16 * PAGESIZE)
+
+#ifdef MALLOC_GUARD_PAGES
+#define GUARD_PAGES 1
+#else
+#define GUARD_PAGES 0
+#endif
+
+static void *_allocate_large(size_t size, size_t alignment) {
+	struct malloc_tag *tag;
+	uint64_t vaddr;
+	size_t offset, count, zeroed;
+
+	offset = MAX(alignment, sizeof(struct malloc_tag));
+	if (size > SIZE_MAX - offset - PAGESIZE)
+		return NULL;
+	count = (offset + size + PAGESIZE - 1) / PAGESIZE;
+	vaddr = allocate_virtual_pages(count + GUARD_PAGES);
+	if (!vaddr)
+		return NULL;
+	if (_map_fresh_pages(vaddr, count, &zeroed)) {
+		free_virtual_pages(vaddr, count + GUARD_PAGES);
+		return NULL;
+	}
+
+	tag = (struct malloc_tag *) (vaddr + offset) - 1;
+	tag->size = count * PAGESIZE | MALLOC_IN_USE | MALLOC_LARGE;
+	tag->magic = MALLOC_MAGIC_USED;
+	zero_skip_base = (uint64_t) (tag + 1);
+	zero_skip_end = vaddr + zeroed * PAGESIZE;
+	return tag + 1;
+}
+
+static uint64_t _large_base(struct malloc_tag *tag) {
+	return (uint64_t) tag & ~(uint64_t) (PAGESIZE - 1);
+}
+
+static void _free_large(struct malloc_tag *tag) {
+	uint64_t vaddr;
+	size_t count;
+
+	vaddr = _large_base(tag);
+	count = BLOCK_SIZE(tag) / PAGESIZE;
+	unmap_pages(vaddr, count, free_consecutive_physical_pages);
+	free_virtual_pages(vaddr, count + GUARD_PAGES);
+}
+
+/* Returns 0 for sizes no block could hold. */
+static size_t _allocation_size(size_t size) {
+	size_t allocsize;
+
+	if (size > SIZE_MAX - sizeof(struct malloc_tag) - MALLOC_GRANULE)
+		return 0;
+	allocsize = sizeof(struct malloc_tag) + size;
+	allocsize = MAX(allocsize, MIN_REGION_SIZE);
+
+	/* align allocsize to the granule */
+	if (allocsize % MALLOC_GRANULE)
+		allocsize += MALLOC_GRANULE - allocsize % MALLOC_GRANULE;
+	return allocsize;
 }
 
+/* Returns where in region an allocation whose data is aligned to */
+/* alignment would start. Space skipped at the front must be able to stay */
+/* behind as a free region of its own. */
+static uint64_t _aligned_start(struct malloc_free_region *region, size_t alignment) {
+	uint64_t base, start;
+
+	base = (uint64_t) region;
+	start = ((base + sizeof(struct malloc_tag) + alignment - 1) & ~(uint64_t) (alignment - 1))
+		- sizeof(struct malloc_tag);
+	if (start != base && start - base < MIN_REGION_SIZE)
+		start += alignment;
+	return start;
+}
 
+/* Alignments up to MALLOC_GRANULE come for free, larger ones are carved */
+/* out of kernel_allocation_chain by splitting the unaligned front of a */
+/* region off as a free region, which stays usable, rather than padding */
+/* each allocation by the alignment. */
 void *malloc_aligned(size_t size, size_t alignment) {
 	size_t allocsize;
+	uint64_t start;
 	struct malloc_tag *allocation;
-	struct malloc_free_region **region;
-	struct malloc_free_region *newregion;
-	(void) alignment;
+	struct malloc_free_region *region;
 
-	if (!kernel_allocation_chain)
+	if (!malloc_initalized)
 		panic("malloc_aligned(): Kernel allocation never primed");
-	if (size == 0)
+	if (size == 0 || alignment & (alignment - 1))
 		return NULL;
 
-	allocsize = sizeof(struct malloc_tag) + size;
-	allocsize = MAX(allocsize, sizeof(struct malloc_free_region));
+	allocsize = _allocation_size(size);
+	if (!allocsize)
+		return NULL;
 
-	/*align allocsize to sizeof malloc_free_region */
-	if (allocsize % sizeof(struct malloc_free_region))
-		allocsize += sizeof(struct malloc_free_region) - allocsize % sizeof(struct malloc_free_region);
+	if (size >= LARGE_ALLOCATION_SIZE && alignment <= PAGESIZE)
+		return _allocate_large(size, alignment);
+	if (alignment > MALLOC_GRANULE)
+		goto aligned;
+
+	if (allocsize <= SMALL_MAX_SIZE) {
+		allocation = _magazine_allocate(_small_class(allocsize));
+		if (allocation)
+			return allocation;
+		allocation = _allocate_small(allocsize);
+		if (allocation)
+			return allocation;
+	}
 
-	for (region = &kernel_allocation_chain; *region != NULL; region = &(*region)->next)
-		if ((*region)->size >= allocsize)
+	for (region = kernel_allocation_chain; region != NULL; region = region->next)
+		if (BLOCK_SIZE(region) >= allocsize)
 			break;
 
-	if (!*region) {
-		if (claim_new_memory(allocsize))
+	if (!region) {
+		if (!_flush_small_classes() && claim_new_memory(allocsize))
 			return NULL;
 		return malloc_aligned(size, alignment);
 	}
 
-	if ((*region)->size < allocsize + sizeof(struct malloc_free_region))
-		return allocate_entire_region(region);
-	else
-		return allocate_partial_region(region, allocsize);
+	return _carve(region, (uint64_t) region, allocsize);
+
+aligned:
+	if (allocsize > SIZE_MAX - alignment - MIN_REGION_SIZE)
+		return NULL;
+	for (region = kernel_allocation_chain; region != NULL; region = region->next) {
+		start = _aligned_start(region, alignment);
+		if (start + allocsize <= (uint64_t) NEXT_BLOCK(region))
+			break;
+	}
+
+	if (!region) {
+		if (!_flush_small_classes() && claim_new_memory(allocsize + alignment + MIN_REGION_SIZE))
+			return NULL;
+		return malloc_aligned(size, alignment);
+	}
+
+	return _carve(region, start, allocsize);
 }
 
 void *malloc(size_t size) {
 	return malloc_aligned(size, DEFAULT_ALIGNMENT);
 }
 
+static struct malloc_tag *_used_tag(void *ptr, const char *caller) {
+	struct malloc_tag *tag;
+
+	tag = (struct malloc_tag *) ptr - 1;
+	if (tag->magic == MALLOC_MAGIC_CACHED)
+		panic("%s(): pointer %p was already freed", caller, ptr);
+	if (tag->magic != MALLOC_MAGIC_USED || !(tag->size & MALLOC_IN_USE))
+		panic("%s(): pointer %p freed, and had a magic value of %llx, but %llx was expected",
+			caller, ptr, tag->magic, MALLOC_MAGIC_USED);
+	return tag;
+}
+
 void free(void *ptr) {
 	struct malloc_tag *tag;
-	struct malloc_free_region *region;
 	size_t size;
 
-	tag = (struct malloc_tag *) ptr - 1;
+	if (!ptr)
+		return;
 
-	if (tag->magic != MALLOC_MAGIC_USED)
-		panic("free(): pointer %p freed, and had a magic value of %llx, but %llx was expected",
-			ptr, tag->magic, MALLOC_MAGIC_USED);
+	tag = _used_tag(ptr, "free");
+	if (tag->size & MALLOC_LARGE) {
+		_free_large(tag);
+		return;
+	}
 
-	size = tag->size;
-	region = (void *) tag;
-	region->size = size;
+	size = BLOCK_SIZE(tag);
+	if (size <= SMALL_MAX_SIZE && !_magazine_free(_small_class(size), ptr))
+		return;
 
-	insert_free_region(region);
+	if (size <= SMALL_MAX_SIZE)
+		_push_small((struct malloc_free_region *) tag);
+	else
+		_release_block(tag);
+}
+
+void *calloc(size_t count, size_t size) {
+	uint8_t *ptr;
+	uint64_t end, skip_base, skip_end;
+
+	if (size && count > SIZE_MAX / size)
+		return NULL;
+
+	zero_skip_base = zero_skip_end = 0;
+	ptr = malloc(count * size);
+	if (!ptr)
+		return NULL;
+
+	end = (uint64_t) ptr + count * size;
+	skip_base = MAX(zero_skip_base, (uint64_t) ptr);
+	skip_end = MIN(zero_skip_end, end);
+	if (skip_base >= skip_end) {
+		memset(ptr, 0, count * size);
+	} else {
+		memset(ptr, 0, skip_base - (uint64_t) ptr);
+		memset((void *) skip_end, 0, end - skip_end);
+	}
+	return ptr;
+}
+
+/* Grows a block in place when the block right after it is free and */
+/* large enough, and shrinks it in place by freeing its tail. Otherwise */
+/* the block moves. */
+void *realloc(void *ptr, size_t size) {
+	struct malloc_tag *tag, *tail;
+	struct malloc_free_region *next;
+	size_t allocsize, old, total;
+	void *moved;
+
+	if (!ptr)
+		return malloc(size);
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+
+	tag = _used_tag(ptr, "realloc");
+	allocsize = _allocation_size(size);
+	if (!allocsize)
+		return NULL;
+	old = BLOCK_SIZE(tag);
+
+	/* large allocations keep their pages unless they outgrow them */
+	if (tag->size & MALLOC_LARGE) {
+		old = _large_base(tag) + old - (uint64_t) tag;
+		if (old >= allocsize)
+			return ptr;
+		goto move;
+	}
+
+	if (old >= allocsize) {
+		if (old - allocsize >= MIN_REGION_SIZE) {
+			tail = (struct malloc_tag *) ((uint8_t *) tag + allocsize);
+			tail->size = (old - allocsize) | MALLOC_IN_USE;
+			tail->magic = MALLOC_MAGIC_USED;
+			tag->size = allocsize | (tag->size & MALLOC_FLAGS);
+			free(tail + 1);
+		}
+		return ptr;
+	}
+
+	next = (struct malloc_free_region *) NEXT_BLOCK(tag);
+	if (!(next->size & MALLOC_IN_USE) && old + BLOCK_SIZE(next) >= allocsize) {
+		total = old + BLOCK_SIZE(next);
+		_unlink_region(next);
+		if (total - allocsize < MIN_REGION_SIZE)
+			allocsize = total;
+		_dirty_fresh((uint64_t) next, (uint64_t) tag + allocsize);
+		tag->size = allocsize | (tag->size & MALLOC_FLAGS);
+		if (allocsize != total)
+			_make_free((struct malloc_free_region *) NEXT_BLOCK(tag), total - allocsize);
+		else
+			NEXT_BLOCK(tag)->size &= ~(size_t) MALLOC_PREV_FREE;
+		return ptr;
+	}
+
+move:
+	moved = malloc(size);
+	if (!moved)
+		return NULL;
+	memcpy(moved, ptr, old - sizeof(struct malloc_tag));
+	free(ptr);
+	return moved;
 }
@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "memory.h"
+#include "cpu.h"
+#include "terminal.h"
+#include "util.h"
+
+#define MAX_NUMA_RANGES 64
+#define MAX_NUMA_CPUS 256
+
+/* Proximity domains are arbitrary 32 bit numbers, nodes are the dense */
+/* indices the allocator uses for them, in order of first appearance. */
+static uint32_t node_domains[MAX_NUMA_NODES];
+static unsigned node_count = 1;
+
+static struct {
+	uint64_t base;
+	uint64_t end;
+	uint8_t node;
+} memory_ranges[MAX_NUMA_RANGES];
+static size_t memory_range_count;
+
+static struct {
+	uint32_t apic_id;
+	uint8_t node;
+} cpu_affinities[MAX_NUMA_CPUS];
+static size_t cpu_affinity_count;
+
+static uint8_t cpu_nodes[MAX_CPU_COUNT];
+static uint8_t distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+static uint8_t fallback_orders[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static int _node_for_domain(uint32_t domain) {
+	unsigned i;
+
+	for (i = 0; i < node_count; i++)
+		if (node_domains[i] == domain)
+			return i;
+
+	if (node_count == MAX_NUMA_NODES) {
+		printf("Ignoring NUMA proximity domain %u\n", domain);
+		return -1;
+	}
+	node_domains[node_count] = domain;
+	return node_count++;
+}
+
+static void _add_memory(struct acpi_srat_memory *entry) {
+	int node;
+	uint64_t base, length;
+
+	if (!(entry->flags & ACPI_SRAT_ENABLED))
+		return;
+
+	base = (uint64_t) entry->base_high << 32 | entry->base_low;
+	length = (uint64_t) entry->length_high << 32 | entry->length_low;
+	node = _node_for_domain((uint32_t) entry->proximity_high << 16 | entry->proximity_low);
+	if (node < 0 || !length || memory_range_count == MAX_NUMA_RANGES)
+		return;
+
+	memory_ranges[memory_range_count].base = base;
+	memory_ranges[memory_range_count].end = base + length;
+	memory_ranges[memory_range_count].node = node;
+	memory_range_count++;
+}
+
+static void _add_cpu(uint32_t apic_id, uint32_t domain, uint32_t flags) {
+	int node;
+
+	if (!(flags & ACPI_SRAT_ENABLED) || cpu_affinity_count == MAX_NUMA_CPUS)
+		return;
+
+	node = _node_for_domain(domain);
+	if (node < 0)
+		return;
+
+	cpu_affinities[cpu_affinity_count].apic_id = apic_id;
+	cpu_affinities[cpu_affinity_count].node = node;
+	cpu_affinity_count++;
+}
+
+static void _parse_srat(struct acpi_sdt_header *srat) {
+	uint8_t *entry, *end;
+	struct acpi_srat_processor *processor;
+	struct acpi_srat_x2apic *x2apic;
+
+	/* the SRAT lists domains in any order, node 0 is rebuilt from it */
+	node_count = 0;
+	end = (uint8_t *) srat + srat->length;
+	for (entry = (uint8_t *) srat + ACPI_SRAT_ENTRIES_OFFSET;
+			entry + sizeof(struct acpi_srat_entry) <= end;
+			entry += ((struct acpi_srat_entry *) entry)->length) {
+		if (((struct acpi_srat_entry *) entry)->length < sizeof(struct acpi_srat_entry))
+			break;
+
+		switch (((struct acpi_srat_entry *) entry)->type) {
+			case ACPI_SRAT_PROCESSOR:
+				processor = (struct acpi_srat_processor *) entry;
+				_add_cpu(processor->apic_id, (uint32_t) processor->proximity_high[2] << 24 |
+					(uint32_t) processor->proximity_high[1] << 16 |
+					(uint32_t) processor->proximity_high[0] << 8 | processor->proximity_low,
+					processor->flags);
+				break;
+			case ACPI_SRAT_MEMORY:
+				_add_memory((struct acpi_srat_memory *) entry);
+				break;
+			case ACPI_SRAT_X2APIC:
+				x2apic = (struct acpi_srat_x2apic *) entry;
+				_add_cpu(x2apic->x2apic_id, x2apic->proximity, x2apic->flags);
+				break;
+		}
+	}
+
+	if (!node_count)
+		node_count = 1;
+}
+
+/* SLIT localities are indexed by proximity domain. */
+static void _parse_slit(struct acpi_sdt_header *slit) {
+	uint64_t count;
+	unsigned from, to;
+	uint8_t *matrix;
+
+	if (slit->length < ACPI_SLIT_ENTRIES_OFFSET)
+		return;
+	memcpy(&count, (uint8_t *) slit + ACPI_SLIT_COUNT_OFFSET, sizeof(uint64_t));
+	if (count > 0xff || slit->length < ACPI_SLIT_ENTRIES_OFFSET + count * count)
+		return;
+
+	matrix = (uint8_t *) slit + ACPI_SLIT_ENTRIES_OFFSET;
+	for (from = 0; from < node_count; from++) {
+		for (to = 0; to < node_count; to++) {
+			if (node_domains[from] < count && node_domains[to] < count)
+				distances[from][to] = matrix[node_domains[from] * count + node_domains[to]];
+		}
+	}
+}
+
+static void _build_fallback_orders(void) {
+	unsigned node, other, j, count;
+	uint8_t *order;
+
+	for (node = 0; node < node_count; node++) {
+		/* the node itself first, then the others sorted by distance */
+		order = fallback_orders[node];
+		order[0] = node;
+		count = 1;
+		for (other = 0; other < node_count; other++) {
+			if (other == node)
+				continue;
+
+			for (j = count; j > 1 && distances[node][order[j - 1]] > distances[node][other]; j--)
+				order[j] = order[j - 1];
+			order[j] = other;
+			count++;
+		}
+	}
+}
+
+static unsigned _current_apic_id(void) {
+	struct cpuid_result res;
+
+	cpuid(1, 0, &res);
+	return res.ebx >> 24;
+}
+
+void initalize_numa(void) {
+	struct acpi_sdt_header *srat, *slit;
+	unsigned from, to;
+	size_t i;
+	uint32_t apic_id;
+
+	srat = find_acpi_table("SRAT");
+	if (srat)
+		_parse_srat(srat);
+
+	for (from = 0; from < node_count; from++)
+		for (to = 0; to < node_count; to++)
+			distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+
+	slit = find_acpi_table("SLIT");
+	if (srat && slit)
+		_parse_slit(slit);
+	_build_fallback_orders();
+
+	/* Only the bootstrap processor runs yet, the others will look */
+	/* themselves up the same way when they are started. */
+	apic_id = _current_apic_id();
+	for (i = 0; i < cpu_affinity_count; i++)
+		if (cpu_affinities[i].apic_id == apic_id)
+			cpu_nodes[current_cpu_index()] = cpu_affinities[i].node;
+}
+
+unsigned numa_node_count(void) {
+	return node_count;
+}
+
+unsigned numa_node_of_range(uint64_t base, uint64_t end) {
+	size_t i;
+	uint64_t lowest;
+	unsigned node;
+
+	node = 0;
+	lowest = UINT64_MAX;
+	for (i = 0; i < memory_range_count; i++) {
+		if (memory_ranges[i].base >= end || memory_ranges[i].end <= base)
+			continue;
+
+		if (memory_ranges[i].base < lowest) {
+			lowest = memory_ranges[i].base;
+			node = memory_ranges[i].node;
+		}
+	}
+	return node;
+}
+
+unsigned current_numa_node(void) {
+	return cpu_nodes[current_cpu_index()];
+}
+
+unsigned numa_distance(unsigned from, unsigned to) {
+	if (from >= node_count || to >= node_count)
+		return 0;
+	return distances[from][to];
+}
+
+const uint8_t *numa_fallback_order(unsigned node) {
+	return fallback_orders[node];
+}
@@ -4,183 +4,1532 @@
 #include "cpu.h"
 #include "terminal.h"
 #include "util.h"
+#include "acpi.h"
 
-struct physical_map_entry {
-	uint64_t base;
+/* The physical allocator is a binary buddy allocator. Every free block is */
+/* 2^order pages, naturally aligned, and sits on the free list for its */
+/* order. The list links live in the first bytes of the free block itself */
+/* and are stored as physical addresses, so they survive the switch from */
+/* the uefi identity map to the high physical map. */
+struct buddy_node {
+	uint64_t next;
+	uint64_t prev;
+};
+
+struct free_area {
+	uint64_t head;
+	uint64_t tail;
 	size_t count;
-	struct physical_map_entry *next;
-	struct physical_map_entry *prev;
 };
 
-struct physical_map_entry *physical_map;
+/* Each NUMA node has its own zone of free lists. Zones are assigned a */
+/* node chunk at a time, and a free block never spans two chunks of */
+/* different nodes, so every block belongs to exactly one zone. */
+struct zone {
+	struct free_area free_areas[PHYS_ORDER_COUNT];
+	struct numa_node_stats stats;
+};
 
-void initalize_physical_memory(void) {
+static struct zone zones[MAX_NUMA_NODES];
+
+/* Memory below 16 MiB is held back in a zone of its own for devices that */
+/* cannot address more, and only handed to unconstrained allocations once */
+/* every node is out of memory. Blocks in it never merge past 16 MiB. */
+#define DMA_ZONE_LIMIT (UINT64_C(16) * 1024 * 1024)
+#define DMA_ZONE_MAX_ORDER 12
+
+static struct zone dma_zone;
+
+static const uint64_t dma_limits[] = {
+	0, UINT64_C(1) << 20, DMA_ZONE_LIMIT, UINT64_C(1) << 32
+};
+
+/* The page frame database, one struct page for every frame between */
+/* first_pfn and last_pfn. The head of each free block carries */
+/* PAGE_FRAME_FREE and its order, which is what lets a block find out if */
+/* its buddy is free without walking any list. */
+static uint64_t page_frames;
+static size_t page_frames_size;
+static uint64_t first_pfn, last_pfn;
+
+#define PFN(addr) ((addr) / PAGESIZE)
+#define PFN_SECTION(pfn) ((pfn) >> PHYS_MAX_ORDER)
+
+/* Memory is initialized a section at a time. A section is one maximum */
+/* order block, so no buddy merge ever looks at a frame outside of the */
+/* section it started in, and the descriptors of a section nobody has */
+/* needed yet can stay untouched. Only enough sections to finish booting */
+/* are initialized up front, the rest are deferred until the buddy lists */
+/* run dry or the kernel is idle. */
+#define SECTION_PAGES ((uint64_t) 1 << PHYS_MAX_ORDER)
+#define MAX_MEMORY_SECTIONS 4096 /* 4 TiB */
+
+/* free memory seeded before the rest is deferred */
+#define EAGER_FREE_PAGES ((64 * 1024 * 1024) / PAGESIZE)
+
+static uint64_t initalized_sections[MAX_MEMORY_SECTIONS / 64];
+static uint64_t next_deferred_section;
+static size_t deferred_page_count;
+
+/* Nodes are recorded per chunk of NODE_CHUNK_PAGES, much finer than a */
+/* section, as SRAT ranges need not be aligned to one. In a section with */
+/* chunks of more than one node, blocks never merge past a chunk. */
+#define NODE_CHUNK_ORDER 14 /* 64 MiB */
+#define NODE_CHUNK_PAGES ((uint64_t) 1 << NODE_CHUNK_ORDER)
+#define PFN_NODE_CHUNK(pfn) ((pfn) >> NODE_CHUNK_ORDER)
+#define SECTION_NODE_CHUNKS (SECTION_PAGES / NODE_CHUNK_PAGES)
+
+static uint8_t chunk_nodes[MAX_MEMORY_SECTIONS * SECTION_NODE_CHUNKS];
+static uint64_t mixed_sections[MAX_MEMORY_SECTIONS / 64];
+static int _section_initalized(uint64_t section) {
+	return initalized_sections[section / 64] >> (section % 64) & 1;
+}
+
+static int _is_usable_memory(enum phys_mem_type type) {
+	return type == PHYS_MEM_FREE || type == PHYS_MEM_BOOTSTRAP_USED ||
+		type == PHYS_MEM_USED || type == PHYS_MEM_ACPI_RECLAIMABLE;
+}
+
+static int _frame_tracked(uint64_t page) {
+	return PFN(page) >= first_pfn && PFN(page) < last_pfn &&
+		_section_initalized(PFN_SECTION(PFN(page)));
+}
+
+static struct page *_page(uint64_t page) {
+	struct page *frames;
+	frames = physical_to_virtual(page_frames);
+	return &frames[PFN(page) - first_pfn];
+}
+
+struct page *phys_to_page(uint64_t paddr) {
+	if (!_frame_tracked(paddr))
+		return NULL;
+	return _page(paddr);
+}
+
+uint64_t page_to_phys(struct page *page) {
+	struct page *frames;
+	frames = physical_to_virtual(page_frames);
+	return (first_pfn + (uint64_t) (page - frames)) * PAGESIZE;
+}
+
+static struct buddy_node *_node(uint64_t page) {
+	return physical_to_virtual(page);
+}
+
+static unsigned _page_node(uint64_t page) {
+	return chunk_nodes[PFN_NODE_CHUNK(PFN(page))];
+}
+
+static int _section_mixed(uint64_t section) {
+	return mixed_sections[section / 64] >> (section % 64) & 1;
+}
+
+static int _section_has_node(uint64_t section, unsigned node) {
+	uint64_t chunk;
+
+	for (chunk = section * SECTION_NODE_CHUNKS; chunk < (section + 1) * SECTION_NODE_CHUNKS; chunk++)
+		if (chunk_nodes[chunk] == node)
+			return 1;
+	return 0;
+}
+
+static struct zone *_page_zone(uint64_t page) {
+	if (page < DMA_ZONE_LIMIT)
+		return &dma_zone;
+	return &zones[_page_node(page)];
+}
+
+static unsigned _max_order(uint64_t page) {
+	if (page < DMA_ZONE_LIMIT)
+		return DMA_ZONE_MAX_ORDER;
+	return _section_mixed(PFN_SECTION(PFN(page))) ? NODE_CHUNK_ORDER : PHYS_MAX_ORDER;
+}
+
+static void _push_block(uint64_t page, unsigned order) {
+	struct buddy_node *node;
+	struct free_area *area;
+
+	area = &_page_zone(page)->free_areas[order];
+	node = _node(page);
+	node->prev = 0;
+	node->next = area->head;
+	if (area->head)
+		_node(area->head)->prev = page;
+	else
+		area->tail = page;
+	area->head = page;
+	area->count++;
+	_page_zone(page)->stats.free_pages += (size_t) 1 << order;
+
+	_page(page)->flags |= PAGE_FRAME_FREE;
+	_page(page)->order = order;
+}
+
+/* Blocks at the tail of a free list are the last to be handed out. */
+static void _append_block(uint64_t page, unsigned order) {
+	struct buddy_node *node;
+	struct free_area *area;
+
+	area = &_page_zone(page)->free_areas[order];
+	if (!area->tail) {
+		_push_block(page, order);
+		return;
+	}
+
+	node = _node(page);
+	node->next = 0;
+	node->prev = area->tail;
+	_node(area->tail)->next = page;
+	area->tail = page;
+	area->count++;
+	_page_zone(page)->stats.free_pages += (size_t) 1 << order;
+
+	_page(page)->flags |= PAGE_FRAME_FREE;
+	_page(page)->order = order;
+}
+
+static void _remove_block(uint64_t page, unsigned order) {
+	struct buddy_node *node;
+	struct free_area *area;
+
+	area = &_page_zone(page)->free_areas[order];
+	node = _node(page);
+	if (node->prev)
+		_node(node->prev)->next = node->next;
+	else
+		area->head = node->next;
+	if (node->next)
+		_node(node->next)->prev = node->prev;
+	else
+		area->tail = node->prev;
+	area->count--;
+	_page_zone(page)->stats.free_pages -= (size_t) 1 << order;
+
+	_page(page)->flags &= ~PAGE_FRAME_FREE;
+}
+
+static unsigned _order_for_count(size_t count) {
+	unsigned order;
+
+	for (order = 0; order <= PHYS_MAX_ORDER && ((size_t) 1 << order) < count; order++)
+		;
+	return order;
+}
+
+static int _initalize_deferred_node(int node);
+
+/* Takes the free block page of order k and splits it down to order. */
+static uint64_t _take_block(struct zone *zone, uint64_t page, unsigned k, unsigned order) {
+	_remove_block(page, k);
+
+	/* hand the upper halves back until the block is the requested size */
+	while (k > order) {
+		k--;
+		_push_block(page + (PAGESIZE << k), k);
+	}
+
+	zone->stats.allocations++;
+	return page;
+}
+
+static uint64_t _zone_allocate(struct zone *zone, unsigned order) {
+	unsigned k;
+
+	for (k = order; k <= PHYS_MAX_ORDER; k++)
+		if (zone->free_areas[k].head)
+			return _take_block(zone, zone->free_areas[k].head, k, order);
+	return 0;
+}
+
+/* Address constrained allocations walk the free lists for a block that */
+/* ends below limit. They are rare and mostly served by the small zone */
+/* below 16 MiB, so no ordering of the lists is kept for them. */
+static uint64_t _zone_allocate_below(struct zone *zone, unsigned order, uint64_t limit) {
+	unsigned k;
+	uint64_t page;
+
+	for (k = order; k <= PHYS_MAX_ORDER; k++)
+		for (page = zone->free_areas[k].head; page; page = _node(page)->next)
+			if (page + (PAGESIZE << order) <= limit)
+				return _take_block(zone, page, k, order);
+	return 0;
+}
+
+/* Takes a block from the executing cpu's node, initializing the node's */
+/* deferred sections before falling back to the other nodes in order of */
+/* distance. */
+static uint64_t _buddy_allocate(unsigned order) {
+	unsigned i, node;
+	const uint8_t *fallback;
+	uint64_t page;
+
+	node = current_numa_node();
+	fallback = numa_fallback_order(node);
+	for (i = 0; i < numa_node_count(); i++) {
+		do {
+			page = _zone_allocate(&zones[fallback[i]], order);
+		} while (!page && _initalize_deferred_node(fallback[i]));
+
+		if (page) {
+			if (i)
+				zones[node].stats.fallbacks++;
+			return page;
+		}
+	}
+
+	return _zone_allocate(&dma_zone, order);
+}
+
+/* Takes a block that ends below limit, from the nodes first when the */
+/* limit allows, so the zone below 16 MiB is kept for the devices that */
+/* need it. */
+static uint64_t _buddy_allocate_below(unsigned order, uint64_t limit) {
+	unsigned i;
+	const uint8_t *fallback;
+	uint64_t page;
+
+	if (limit > DMA_ZONE_LIMIT) {
+		fallback = numa_fallback_order(current_numa_node());
+		for (i = 0; i < numa_node_count(); i++) {
+			do {
+				page = _zone_allocate_below(&zones[fallback[i]], order, limit);
+			} while (!page && next_deferred_section * SECTION_PAGES * PAGESIZE < limit &&
+				initalize_deferred_memory());
+			if (page)
+				return page;
+		}
+	}
+
+	return _zone_allocate_below(&dma_zone, order, limit);
+}
+
+static int _free_block_available(unsigned order) {
+	unsigned node;
+
+	for (node = 0; node < numa_node_count(); node++)
+		if (zones[node].free_areas[order].head)
+			return 1;
+	return 0;
+}
+
+static int _is_free_block(uint64_t page, unsigned order) {
+	struct page *desc;
+
+	if (!_frame_tracked(page))
+		return 0;
+	desc = _page(page);
+	return desc->flags & PAGE_FRAME_FREE && desc->order == order;
+}
+
+static void _buddy_free(uint64_t page, unsigned order) {
+	uint64_t buddy, parent;
+
+	while (order < _max_order(page)) {
+		buddy = page ^ (PAGESIZE << order);
+		if (!_is_free_block(buddy, order))
+			break;
+
+		_remove_block(buddy, order);
+		page &= ~(PAGESIZE << order);
+		order++;
+	}
+
+	/* If the block's parent already has a free buddy, this block is one */
+	/* free away from a merge two orders up. Queue it last so small */
+	/* allocations split other blocks first and large aligned blocks */
+	/* can reform instead of being chipped away by 4 KiB churn. */
+	if (order + 1 < _max_order(page)) {
+		parent = page & ~(PAGESIZE << order);
+		if (_is_free_block(parent ^ (PAGESIZE << (order + 1)), order + 1)) {
+			_append_block(page, order);
+			return;
+		}
+	}
+
+	_push_block(page, order);
+}
+
+/* Splits an arbitrary run of pages into the largest naturally aligned */
+/* blocks it contains and frees each of them. */
+static void _free_range(uint64_t page, size_t count) {
+	unsigned order;
+	uint64_t pfn;
+
+	while (count) {
+		pfn = PFN(page);
+		order = pfn ? __builtin_ctzll(pfn) : PHYS_MAX_ORDER;
+		if (order > _max_order(page))
+			order = _max_order(page);
+		while (((size_t) 1 << order) > count)
+			order--;
+
+		_buddy_free(page, order);
+		page += PAGESIZE << order;
+		count -= (size_t) 1 << order;
+	}
+}
+
+/* Always on counters, the rest of get_physical_memory_stats() is */
+/* gathered when it is called. */
+static struct physical_memory_stats counters;
+
+/* Takes a reference on count freshly allocated frames. */
+static void _claim_frames(uint64_t page, size_t count, unsigned order) {
+	struct page *desc;
+
+	counters.allocations++;
+	counters.pages_allocated += count;
+	_page(page)->order = order;
+	for (; count; count--, page += PAGESIZE) {
+		desc = _page(page);
+		desc->refcount = 1;
+		desc->owner = PAGE_OWNER_NONE;
+	}
+}
+
+/* Drops the only reference on count frames, so they can be freed. */
+static void _release_frames(uint64_t page, size_t count) {
+	struct page *desc;
+
+	counters.frees++;
+	counters.pages_freed += count;
+	for (; count; count--, page += PAGESIZE) {
+		desc = _page(page);
+		if (desc->refcount != 1)
+			panic("_release_frames(): page %p freed with a reference count of %u",
+				page, (unsigned) desc->refcount);
+		desc->refcount = 0;
+		desc->owner = PAGE_OWNER_NONE;
+	}
+}
+
+static void _mark_frames(uint64_t base, uint64_t end, enum page_owner owner) {
+	struct page *desc;
+
+	for (base &= PAGEMASK; base < end; base += PAGESIZE) {
+		desc = _page(base);
+		desc->refcount = 1;
+		desc->owner = owner;
+	}
+}
+
+/* Frees, or when seed is zero only counts, the whole pages of [base, end) */
+/* that are not part of the page frame database. */
+static size_t _seed_range(uint64_t base, uint64_t end, int seed) {
+	uint64_t frames_end;
+	size_t count;
+
+	frames_end = page_frames + page_frames_size;
+	if (base < frames_end && page_frames < end) {
+		count = 0;
+		if (base < page_frames)
+			count += _seed_range(base, page_frames, seed);
+		if (frames_end < end)
+			count += _seed_range(frames_end, end, seed);
+		return count;
+	}
+
+	count = (end - base) / PAGESIZE;
+	if (seed)
+		_free_range(base, count);
+	return count;
+}
+
+/* Seeds, or only counts, the free memory of the map between lo and hi. */
+static size_t _seed_free_memory(uint64_t lo, uint64_t hi, int seed) {
+	size_t i, count;
+	uint64_t base, end;
+	struct bootstrap_memory_map_entry *entry;
+
+	count = 0;
+	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		entry = &bootstrap_info.memory.map[i];
+		if (entry->type != PHYS_MEM_FREE)
+			continue;
+
+		base = (entry->base + PAGESIZE - 1) & PAGEMASK;
+		end = (entry->base + entry->size) & PAGEMASK;
+		if (base == 0)
+			base = PAGESIZE;
+		if (base < lo)
+			base = lo;
+		if (end > hi)
+			end = hi;
+
+		if (base < end)
+			count += _seed_range(base, end, seed);
+	}
+
+	return count;
+}
+
+/* Returns nonzero if the section holds anything but free memory, whose */
+/* descriptors have to be valid from the start. */
+static int _section_in_use(uint64_t lo, uint64_t hi) {
 	size_t i;
-	enum phys_mem_type type;
-	uint64_t base, size;
-	uint64_t offset;
+	struct bootstrap_memory_map_entry *entry;
+
+	if (page_frames < hi && lo < page_frames + page_frames_size)
+		return 1;
 
 	for (i = 0; i < bootstrap_info.memory.count; i++) {
-		base = bootstrap_info.memory.map[i].base;
-		size = bootstrap_info.memory.map[i].size;
-		type = bootstrap_info.memory.map[i].type;
-		offset = 0;
+		entry = &bootstrap_info.memory.map[i];
+		if (!_is_usable_memory(entry->type) || entry->type == PHYS_MEM_FREE)
+			continue;
+		if (entry->base < hi && lo < entry->base + entry->size)
+			return 1;
+	}
+	return 0;
+}
+
+static size_t _initalize_section(uint64_t section) {
+	size_t i;
+	uint64_t lo, hi, base, end;
+	struct bootstrap_memory_map_entry *entry;
+
+	lo = section * SECTION_PAGES * PAGESIZE;
+	hi = lo + SECTION_PAGES * PAGESIZE;
+
+	for (i = 0; i < SECTION_PAGES * sizeof(struct page) / PAGESIZE; i++)
+		zero_page_nontemporal((uint8_t *) _page(lo) + i * PAGESIZE);
 
-		if (type != PHYS_MEM_FREE)
+	base = page_frames > lo ? page_frames : lo;
+	end = page_frames + page_frames_size < hi ? page_frames + page_frames_size : hi;
+	if (base < end)
+		_mark_frames(base, end, PAGE_OWNER_KERNEL);
+
+	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		entry = &bootstrap_info.memory.map[i];
+		if (!_is_usable_memory(entry->type) || entry->type == PHYS_MEM_FREE)
 			continue;
 
-		if (base == 0)
-			offset += PAGESIZE;
+		base = entry->base > lo ? entry->base : lo;
+		end = entry->base + entry->size < hi ? entry->base + entry->size : hi;
+		if (base < end)
+			_mark_frames(base, end, PAGE_OWNER_BOOTSTRAP);
+	}
 
-		if (base % PAGESIZE)
-			offset += PAGESIZE - base % PAGESIZE;
+	initalized_sections[section / 64] |= UINT64_C(1) << (section % 64);
+	return _seed_free_memory(lo, hi, 1);
+}
 
-		if (size > offset && size - offset > PAGESIZE) {
-			base += offset;
-			size -= offset;
-			free_consecutive_physical_pages(base, size / PAGESIZE);
+/* Initializes the first deferred section of node, or of any node if */
+/* node is negative. */
+static int _initalize_deferred_node(int node) {
+	uint64_t section;
+
+	while (next_deferred_section < PFN_SECTION(last_pfn) &&
+			_section_initalized(next_deferred_section))
+		next_deferred_section++;
+
+	for (section = next_deferred_section; section < PFN_SECTION(last_pfn); section++)
+		if (!_section_initalized(section) && (node < 0 || _section_has_node(section, node)))
+			break;
+
+	if (section >= PFN_SECTION(last_pfn))
+		return 0;
+
+	deferred_page_count -= _initalize_section(section);
+	return 1;
+}
+
+int initalize_deferred_memory(void) {
+	return _initalize_deferred_node(-1);
+}
+
+size_t deferred_physical_pages(void) {
+	return deferred_page_count;
+}
+
+/* The page frame database has to exist before anything can be freed, so */
+/* it is carved directly out of the first free map entry large enough to */
+/* hold it. Memory above DMA_ZONE_LIMIT is preferred, so the database does */
+/* not use up the zone held back for devices. The entry itself is left */
+/* alone, so the database is still mapped by map_high_physical_memory(), */
+/* and seeding skips over it. The database covers whole sections, so each */
+/* section's descriptors are a page aligned slice of it. */
+static void _create_page_frames(void) {
+	size_t i, pages;
+	int pass;
+	uint64_t base, end;
+	struct bootstrap_memory_map_entry *entry;
+
+	first_pfn = UINT64_MAX;
+	last_pfn = 0;
+	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		entry = &bootstrap_info.memory.map[i];
+		if (!_is_usable_memory(entry->type) || entry->size == 0)
+			continue;
+
+		base = PFN(entry->base);
+		end = PFN(entry->base + entry->size + PAGESIZE - 1);
+		if (base < first_pfn)
+			first_pfn = base;
+		if (end > last_pfn)
+			last_pfn = end;
+	}
+
+	if (first_pfn >= last_pfn)
+		panic("_create_page_frames(): no usable memory");
+
+	first_pfn &= ~(SECTION_PAGES - 1);
+	last_pfn = (last_pfn + SECTION_PAGES - 1) & ~(SECTION_PAGES - 1);
+	if (PFN_SECTION(last_pfn) > MAX_MEMORY_SECTIONS) {
+		printf("Ignoring memory above %p\n", (uint64_t) MAX_MEMORY_SECTIONS * SECTION_PAGES * PAGESIZE);
+		last_pfn = MAX_MEMORY_SECTIONS * SECTION_PAGES;
+	}
+
+	pages = (last_pfn - first_pfn) * sizeof(struct page) / PAGESIZE;
+	for (pass = 0; pass < 2 && !page_frames; pass++) {
+		for (i = 0; i < bootstrap_info.memory.count; i++) {
+			entry = &bootstrap_info.memory.map[i];
+			if (entry->type != PHYS_MEM_FREE || entry->base == 0 || entry->base % PAGESIZE)
+				continue;
+
+			base = entry->base;
+			end = entry->base + entry->size;
+			if (!pass && base < DMA_ZONE_LIMIT)
+				base = DMA_ZONE_LIMIT;
+			if (base < end && (end - base) / PAGESIZE > pages) {
+				page_frames = base;
+				page_frames_size = pages * PAGESIZE;
+				break;
+			}
 		}
 	}
+
+	if (!page_frames)
+		panic("_create_page_frames(): could not find %zu pages for page frames", pages);
 }
 
-uint64_t allocate_consecutive_physical_pages(size_t count) {
-	struct physical_map_entry **entry, *tmp;
-	uint64_t ret;
-
-	for (entry = &physical_map; *entry != NULL; entry = &(*entry)->next) {
-		if ((*entry)->count == count) {
-			tmp = *entry;
-			if (tmp->next)
-				tmp->next->prev = tmp->prev;
-			*entry = tmp->next;
-			ret = tmp->base;
-			free(tmp);
-			return ret;
-		} else if (count < (*entry)->count) {
-			ret = (*entry)->base;
-			(*entry)->base += count * PAGESIZE;
-			(*entry)->count -= count;
-			return ret;
+/* Counts the usable pages of every zone from the memory map. */
+static void _count_zone_pages(void) {
+	size_t i;
+	unsigned node;
+	uint64_t base, end, split;
+	struct bootstrap_memory_map_entry *entry;
+
+	for (node = 0; node < MAX_NUMA_NODES; node++)
+		zones[node].stats.total_pages = 0;
+	dma_zone.stats.total_pages = 0;
+
+	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		entry = &bootstrap_info.memory.map[i];
+		if (!_is_usable_memory(entry->type))
+			continue;
+
+		base = entry->base & PAGEMASK;
+		end = entry->base + entry->size;
+		if (end > last_pfn * PAGESIZE)
+			end = last_pfn * PAGESIZE;
+		for (; base < end; base = split) {
+			split = (PFN_NODE_CHUNK(PFN(base)) + 1) * NODE_CHUNK_PAGES * PAGESIZE;
+			if (base < DMA_ZONE_LIMIT)
+				split = DMA_ZONE_LIMIT;
+			if (split > end)
+				split = end;
+			_page_zone(base)->stats.total_pages += (split - base) / PAGESIZE;
 		}
 	}
+}
+
+static void _detect_cache_colors(void);
+
+void initalize_physical_memory(void) {
+	uint64_t section, lo;
+	size_t seeded;
+
+	_create_page_frames();
+	_detect_cache_colors();
+
+	seeded = 0;
+	for (section = PFN_SECTION(first_pfn); section < PFN_SECTION(last_pfn); section++) {
+		/* the memory held back for devices is never deferred */
+		lo = section * SECTION_PAGES * PAGESIZE;
+		if (lo < DMA_ZONE_LIMIT || _section_in_use(lo, lo + SECTION_PAGES * PAGESIZE))
+			seeded += _initalize_section(section);
+	}
+
+	deferred_page_count = 0;
+	for (section = PFN_SECTION(first_pfn); section < PFN_SECTION(last_pfn); section++) {
+		if (_section_initalized(section))
+			continue;
+
+		lo = section * SECTION_PAGES * PAGESIZE;
+		if (seeded < EAGER_FREE_PAGES)
+			seeded += _initalize_section(section);
+		else
+			deferred_page_count += _seed_free_memory(lo, lo + SECTION_PAGES * PAGESIZE, 0);
+	}
+
+	next_deferred_section = PFN_SECTION(first_pfn);
+	_count_zone_pages();
+}
+
+/* Moves every free block into the zone of its node, once the SRAT is */
+/* known. The blocks are chained through their list links while the */
+/* chunks change hands, with the order kept in the prev link. Blocks */
+/* larger than a chunk in a section of several nodes are split. */
+static void _assign_zones(void) {
+	unsigned node, order, max;
+	uint64_t chunk, last, section, chain, page, end;
+	struct buddy_node *link;
+
+	chain = 0;
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		for (order = 0; order <= PHYS_MAX_ORDER; order++) {
+			while (zones[node].free_areas[order].head) {
+				page = zones[node].free_areas[order].head;
+				_remove_block(page, order);
+				link = _node(page);
+				link->next = chain;
+				link->prev = order;
+				chain = page;
+			}
+		}
+	}
+
+	/* rounded up, so a partial chunk or section at the end is included */
+	last = PFN_NODE_CHUNK(last_pfn + NODE_CHUNK_PAGES - 1);
+	for (chunk = PFN_NODE_CHUNK(first_pfn); chunk < last; chunk++)
+		chunk_nodes[chunk] = numa_node_of_range(chunk * NODE_CHUNK_PAGES * PAGESIZE,
+			(chunk + 1) * NODE_CHUNK_PAGES * PAGESIZE);
+
+	for (chunk = PFN_NODE_CHUNK(first_pfn); chunk < last; chunk++) {
+		section = chunk / SECTION_NODE_CHUNKS;
+		if (chunk_nodes[chunk] != chunk_nodes[section * SECTION_NODE_CHUNKS])
+			mixed_sections[section / 64] |= UINT64_C(1) << (section % 64);
+	}
+
+	while (chain) {
+		page = chain;
+		link = _node(page);
+		chain = link->next;
+		order = link->prev;
+		max = _max_order(page);
+		if (order <= max) {
+			_push_block(page, order);
+			continue;
+		}
+		for (end = page + (PAGESIZE << order); page < end; page += PAGESIZE << max)
+			_push_block(page, max);
+	}
+
+	_count_zone_pages();
+	if (numa_node_count() > 1)
+		for (node = 0; node < numa_node_count(); node++)
+			printf("NUMA node %u: 0x%zx bytes\n", node, zones[node].stats.total_pages * PAGESIZE);
+}
+
+void get_numa_node_stats(unsigned node, struct numa_node_stats *stats) {
+	if (node >= numa_node_count()) {
+		memset(stats, 0, sizeof(struct numa_node_stats));
+		return;
+	}
+	*stats = zones[node].stats;
+}
+
+/* Single pages are served from a small per-cpu stack of recently freed, */
+/* and so probably cache-hot, frames. The stack only touches the buddy */
+/* lists in batches: it is refilled with PAGE_CACHE_BATCH frames when it */
+/* runs dry, and its coldest PAGE_CACHE_BATCH frames are drained back when */
+/* it fills up. */
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH 16
+
+struct page_cache {
+	size_t count;
+	uint64_t pages[PAGE_CACHE_SIZE]; /* pages[count - 1] is the hottest */
+};
 
+static struct page_cache page_caches[MAX_CPU_COUNT];
+
+static void _page_cache_refill(struct page_cache *cache) {
+	uint64_t page;
+
+	while (cache->count < PAGE_CACHE_BATCH) {
+		page = _buddy_allocate(0);
+		if (!page)
+			break;
+		_page(page)->flags |= PAGE_FRAME_CACHED;
+		cache->pages[cache->count++] = page;
+	}
+}
+
+/* Returns the coldest count pages of the cache to the buddy lists. */
+static size_t _page_cache_drain(struct page_cache *cache, size_t count) {
+	size_t i;
+
+	if (count > cache->count)
+		count = cache->count;
+
+	for (i = 0; i < count; i++) {
+		_page(cache->pages[i])->flags &= ~PAGE_FRAME_CACHED;
+		_buddy_free(cache->pages[i], 0);
+	}
+	for (i = count; i < cache->count; i++)
+		cache->pages[i - count] = cache->pages[i];
+	cache->count -= count;
+
+	return count;
+}
+
+static uint64_t _page_cache_allocate(void) {
+	struct page_cache *cache;
+	uint64_t page;
+
+	cache = &page_caches[current_cpu_index()];
+	if (!cache->count)
+		_page_cache_refill(cache);
+	if (!cache->count)
+		return 0;
+
+	page = cache->pages[--cache->count];
+	_page(page)->flags &= ~PAGE_FRAME_CACHED;
+	return page;
+}
+
+static void _page_cache_free(uint64_t page) {
+	struct page_cache *cache;
+
+	/* remote and low frames go straight back to their own zone */
+	if (page < DMA_ZONE_LIMIT || _page_node(page) != current_numa_node()) {
+		_buddy_free(page, 0);
+		return;
+	}
+
+	cache = &page_caches[current_cpu_index()];
+	if (cache->count == PAGE_CACHE_SIZE)
+		_page_cache_drain(cache, PAGE_CACHE_BATCH);
+
+	_page(page)->flags |= PAGE_FRAME_CACHED;
+	cache->pages[cache->count++] = page;
+}
+
+/* Frames zeroed ahead of time by refill_zeroed_pages(), so that */
+/* PHYS_PAGE_ALLOC_ZERO allocations of a single page, page tables above all, */
+/* do not pay for clearing it. */
+#define ZEROED_POOL_SIZE 256
+#define ZEROED_POOL_BATCH 8
+
+static struct {
+	size_t count;
+	uint64_t pages[ZEROED_POOL_SIZE];
+} zeroed_pool;
+
+static uint64_t _zeroed_pool_allocate(void) {
+	uint64_t page;
+
+	if (!zeroed_pool.count)
+		return 0;
+
+	page = zeroed_pool.pages[--zeroed_pool.count];
+	_page(page)->flags &= ~PAGE_FRAME_ZEROED;
+	_claim_frames(page, 1, 0);
+	return page;
+}
+
+static size_t _zeroed_pool_drain(void) {
+	size_t count;
+	uint64_t page;
+
+	count = zeroed_pool.count;
+	while (zeroed_pool.count) {
+		page = zeroed_pool.pages[--zeroed_pool.count];
+		_page(page)->flags &= ~PAGE_FRAME_ZEROED;
+		_buddy_free(page, 0);
+	}
+	return count;
+}
+
+size_t zeroed_physical_pages(void) {
+	return zeroed_pool.count;
+}
+
+int refill_zeroed_pages(void) {
+	size_t i;
+	uint64_t page;
+
+	for (i = 0; i < ZEROED_POOL_BATCH && zeroed_pool.count < ZEROED_POOL_SIZE; i++) {
+		/* cold frames straight from the buddy lists, the hot ones are */
+		/* better left in the page caches than flushed by the stores */
+		page = _buddy_allocate(0);
+		if (!page)
+			break;
+
+		zero_page_nontemporal(physical_to_virtual(page));
+		_page(page)->flags |= PAGE_FRAME_ZEROED;
+		zeroed_pool.pages[zeroed_pool.count++] = page;
+	}
+
+	return i != 0;
+}
+
+/* Frames are colored by the cache sets they map to in the largest data */
+/* cache: a way of that cache spans cache_colors pages, and a frame's */
+/* color is its pfn modulo that. Colored allocations are served from */
+/* small per-color bins, refilled by splitting one aligned block that */
+/* holds a frame of every color. */
+#define MAX_CACHE_COLORS 1024
+#define COLOR_BIN_SIZE 4
+#define COLOR_REFILL_TRIES 64
+
+#define CPUID_CACHE_PARAMETERS 4
+#define CPUID_CACHE_DATA 1
+#define CPUID_CACHE_UNIFIED 3
+
+static unsigned cache_colors = 1;
+static unsigned cache_color_order;
+static unsigned cache_ways = 1;
+
+static struct {
+	size_t count;
+	uint64_t pages[COLOR_BIN_SIZE];
+} color_bins[MAX_CACHE_COLORS];
+
+/* Cpuid leaf 4 describes one cache per subleaf, until a null type. */
+static void _detect_cache_colors(void) {
+	struct cpuid_result res;
+	uint32_t subleaf, type;
+	uint64_t way_size, largest;
+
+	cpuid(0, 0, &res);
+	if (res.eax < CPUID_CACHE_PARAMETERS)
+		return;
+
+	largest = 0;
+	for (subleaf = 0;; subleaf++) {
+		cpuid(CPUID_CACHE_PARAMETERS, subleaf, &res);
+		type = res.eax & 0x1f;
+		if (!type)
+			break;
+		if (type != CPUID_CACHE_DATA && type != CPUID_CACHE_UNIFIED)
+			continue;
+
+		/* line size * partitions * sets */
+		way_size = (uint64_t) ((res.ebx & 0xfff) + 1) * (((res.ebx >> 12) & 0x3ff) + 1) *
+			((uint64_t) res.ecx + 1);
+		if (way_size > largest) {
+			largest = way_size;
+			cache_ways = (res.ebx >> 22) + 1;
+		}
+	}
+
+	while (cache_colors < MAX_CACHE_COLORS && ((uint64_t) cache_colors << 1) * PAGESIZE <= largest) {
+		cache_colors <<= 1;
+		cache_color_order++;
+	}
+}
+
+unsigned cache_color(uint64_t address) {
+	return (address / PAGESIZE) & (cache_colors - 1);
+}
+
+unsigned cache_color_count(void) {
+	return cache_colors;
+}
+
+size_t colored_cache_size(void) {
+	return (size_t) cache_colors * cache_ways * PAGESIZE;
+}
+
+static void _color_bin_put(uint64_t page) {
+	unsigned color;
+
+	color = cache_color(page);
+	if (color_bins[color].count == COLOR_BIN_SIZE) {
+		_buddy_free(page, 0);
+		return;
+	}
+
+	_page(page)->flags |= PAGE_FRAME_CACHED;
+	color_bins[color].pages[color_bins[color].count++] = page;
+}
+
+static void _color_bin_refill(unsigned color) {
+	uint64_t page, end;
+	size_t i;
+
+	page = _buddy_allocate(cache_color_order);
+	if (page) {
+		end = page + (PAGESIZE << cache_color_order);
+		for (; page < end; page += PAGESIZE)
+			_color_bin_put(page);
+		return;
+	}
+
+	/* no block is large enough, sift single frames instead */
+	for (i = 0; i < COLOR_REFILL_TRIES && !color_bins[color].count; i++) {
+		page = _buddy_allocate(0);
+		if (!page)
+			break;
+		_color_bin_put(page);
+	}
+}
+
+static uint64_t _allocate_colored(unsigned color) {
+	uint64_t page;
+
+	if (!color_bins[color].count)
+		_color_bin_refill(color);
+	if (!color_bins[color].count)
+		return 0;
+
+	page = color_bins[color].pages[--color_bins[color].count];
+	_page(page)->flags &= ~PAGE_FRAME_CACHED;
+	_claim_frames(page, 1, 0);
+	return page;
+}
+
+static size_t _color_bins_drain(void) {
+	size_t count;
+	unsigned color;
+	uint64_t page;
+
+	count = 0;
+	for (color = 0; color < cache_colors; color++) {
+		while (color_bins[color].count) {
+			page = color_bins[color].pages[--color_bins[color].count];
+			_page(page)->flags &= ~PAGE_FRAME_CACHED;
+			_buddy_free(page, 0);
+			count++;
+		}
+	}
+	return count;
+}
+
+int allocate_colored_physical_pages(uint64_t *pages, size_t count, unsigned color) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		pages[i] = _allocate_colored((color + i) & (cache_colors - 1));
+		if (!pages[i] && drain_physical_page_caches())
+			pages[i] = _allocate_colored((color + i) & (cache_colors - 1));
+		if (!pages[i])
+			goto fail;
+	}
 	return 0;
+
+fail:
+	counters.failures++;
+	while (i--)
+		free_consecutive_physical_pages(pages[i], 1);
+	return 1;
 }
 
-static int _regions_overlap(uint64_t base1, uint64_t end1, uint64_t base2, uint64_t end2) {
-	return base1 < base2 && base2 < end1 || base2 < base1 && base1 < end2;
+size_t drain_physical_page_caches(void) {
+	size_t i, count;
+
+	count = _zeroed_pool_drain() + _color_bins_drain();
+	for (i = 0; i < MAX_CPU_COUNT; i++)
+		count += _page_cache_drain(&page_caches[i], PAGE_CACHE_SIZE);
+	return count;
 }
 
-static void _merge_into_below_region(struct physical_map_entry *entry, uint64_t page, size_t count) {
-	struct physical_map_entry *next;
-	uint64_t end;
-	entry->count += count;
-	end = page + count * PAGESIZE;
+static void _add_zone_stats(struct zone *zone, struct physical_memory_stats *stats) {
+	unsigned order;
 
-	next = entry->next;
-	if (next && next->base == end) {
-		entry->count += next->count;
-		entry->next = next->next;
-		if (next->next)
-			next->next->prev = entry;
-		free(next);
+	stats->total_pages += zone->stats.total_pages;
+	stats->free_pages += zone->stats.free_pages;
+	for (order = 0; order <= PHYS_MAX_ORDER; order++) {
+		stats->free_blocks_by_order[order] += zone->free_areas[order].count;
+		stats->free_blocks += zone->free_areas[order].count;
+		if (zone->free_areas[order].count)
+			stats->largest_free_block = (size_t) 1 << order;
 	}
 }
 
-static void _insert_entry(struct physical_map_entry **ptr, uint64_t base, size_t count) {
-	struct physical_map_entry *entry;
-	uint64_t end;
+void get_physical_memory_stats(struct physical_memory_stats *stats) {
+	unsigned node, order;
+	size_t i, large;
+
+	*stats = counters;
+	stats->timestamp = read_tsc();
+	stats->deferred_pages = deferred_page_count;
 
-	end = base + count * PAGESIZE;
-	if (*ptr && end == (*ptr)->base) {
-		(*ptr)->base = base;
-		(*ptr)->count += count;
+	for (node = 0; node < numa_node_count(); node++)
+		_add_zone_stats(&zones[node], stats);
+	_add_zone_stats(&dma_zone, stats);
+
+	stats->cached_pages = zeroed_pool.count;
+	for (i = 0; i < MAX_CPU_COUNT; i++)
+		stats->cached_pages += page_caches[i].count;
+	for (i = 0; i < cache_colors; i++)
+		stats->cached_pages += color_bins[i].count;
+
+	/* the share of free memory that cannot back a 2 MiB allocation */
+	large = 0;
+	for (order = LARGE_PAGE_ORDER; order <= PHYS_MAX_ORDER; order++)
+		large += stats->free_blocks_by_order[order] << order;
+	if (stats->free_pages)
+		stats->fragmentation_index = 1000 - large * 1000 / stats->free_pages;
+}
+
+/* Allocates count consecutive pages starting on a 2^align page boundary, */
+/* and ending below limit unless limit is 0. */
+static uint64_t _allocate_consecutive(size_t count, unsigned align, uint64_t limit) {
+	unsigned order;
+	uint64_t page;
+
+	if (count == 0)
+		return 0;
+
+	if (count == 1 && align == 0 && !limit) {
+		page = _page_cache_allocate();
+		if (page)
+			_claim_frames(page, 1, 0);
+		else
+			counters.failures++;
+		return page;
+	}
+
+	order = _order_for_count(count);
+	if (order < align)
+		order = align;
+	if (order > PHYS_MAX_ORDER) {
+		counters.failures++;
+		return 0;
+	}
+
+	if (limit) {
+		page = _buddy_allocate_below(order, limit);
+		if (!page && drain_physical_page_caches())
+			page = _buddy_allocate_below(order, limit);
 	} else {
-		entry = malloc(sizeof(struct physical_map_entry));
-		if (!entry)
-			panic("_insert_entry(): could not allocate memory for physical map entry");
+		page = _buddy_allocate(order);
+		if (!page && drain_physical_page_caches())
+			page = _buddy_allocate(order);
+		if (!page && order && !compact_physical_memory(order))
+			page = _buddy_allocate(order);
+	}
+	if (!page) {
+		counters.failures++;
+		return 0;
+	}
+
+	/* give back the tail of the block the caller did not ask for */
+	if (((size_t) 1 << order) > count)
+		_free_range(page + count * PAGESIZE, ((size_t) 1 << order) - count);
+
+	_claim_frames(page, count, order);
+	return page;
+}
+
+/* Compaction frees an aligned block of a given order by moving the heap */
+/* pages out of it. The block with the fewest pages to move, and nothing */
+/* that cannot move, is picked. Its free blocks are taken off the free */
+/* lists first, so the frames the pages move to always come from outside */
+/* of it. Only heap pages are movable, they are the only frames with */
+/* a single mapping the kernel knows how to find. Pinned heap memory is */
+/* owned by the kernel, so it stays where it is. */
+static struct compaction_stats compaction_stats;
 
-		entry->base = base;
-		entry->count = count;
-		entry->next = *ptr;
-		entry->prev = (*ptr)->prev;
-		(*ptr)->prev = entry;
-		*ptr = entry;
+/* Returns the number of frames to move to free the block at page, or -1 */
+/* if something in it cannot be moved. */
+static int _compaction_cost(uint64_t page, unsigned order) {
+	uint64_t end;
+	struct page *desc;
+	int cost;
+
+	cost = 0;
+	end = page + (PAGESIZE << order);
+	while (page < end) {
+		desc = _page(page);
+		if (desc->flags & PAGE_FRAME_FREE) {
+			page += PAGESIZE << desc->order;
+			continue;
+		}
+
+		if (desc->refcount != 1 || desc->owner != PAGE_OWNER_HEAP || desc->flags)
+			return -1;
+		cost++;
+		page += PAGESIZE;
+	}
+	return cost;
+}
+
+static uint64_t _compaction_replace(uint64_t frame) {
+	struct page *desc;
+	uint64_t page;
+
+	desc = _page(frame);
+	if (desc->refcount != 1 || desc->owner != PAGE_OWNER_HEAP)
+		return 0;
+
+	page = _allocate_consecutive(1, 0, 0);
+	if (!page)
+		return 0;
+	_page(page)->owner = PAGE_OWNER_HEAP;
+
+	desc->refcount = 0;
+	desc->owner = PAGE_OWNER_NONE;
+	compaction_stats.pages_migrated++;
+	return page;
+}
+
+/* Gives back the runs of frames in the block that are no longer used. */
+static void _compaction_release(uint64_t page, uint64_t end) {
+	uint64_t run;
+
+	while (page < end) {
+		for (run = page; run < end && !_page(run)->refcount; run += PAGESIZE)
+			;
+		if (run > page)
+			_free_range(page, (run - page) / PAGESIZE);
+		page = run + PAGESIZE;
 	}
 }
 
+int compact_physical_memory(unsigned order) {
+	uint64_t page, best, end;
+	struct page *desc;
+	int cost, best_cost;
+
+	if (order > PHYS_MAX_ORDER)
+		return 1;
+
+	compaction_stats.runs++;
+	drain_physical_page_caches();
+
+	best = 0;
+	best_cost = -1;
+	page = (first_pfn * PAGESIZE + (PAGESIZE << order) - 1) & ~((PAGESIZE << order) - 1);
+	if (page < DMA_ZONE_LIMIT)
+		page = DMA_ZONE_LIMIT;
+	for (; page < last_pfn * PAGESIZE; page += PAGESIZE << order) {
+		if (!_frame_tracked(page))
+			continue;
+
+		cost = _compaction_cost(page, order);
+		compaction_stats.blocks_scanned++;
+		if (cost >= 0 && (best_cost < 0 || cost < best_cost)) {
+			best = page;
+			best_cost = cost;
+		}
+	}
+
+	if (best_cost < 0) {
+		compaction_stats.failures++;
+		return 1;
+	}
+
+	end = best + (PAGESIZE << order);
+	for (page = best; page < end; page += PAGESIZE) {
+		desc = _page(page);
+		if (desc->flags & PAGE_FRAME_FREE) {
+			_remove_block(page, desc->order);
+			page += (PAGESIZE << desc->order) - PAGESIZE;
+		}
+	}
+
+	remap_heap_frames(best, end, _compaction_replace);
+
+	for (page = best; page < end; page += PAGESIZE) {
+		if (_page(page)->refcount) {
+			_compaction_release(best, end);
+			compaction_stats.failures++;
+			return 1;
+		}
+	}
+
+	_free_range(best, (size_t) 1 << order);
+	compaction_stats.successes++;
+	return 0;
+}
+
+void get_compaction_stats(struct compaction_stats *stats) {
+	*stats = compaction_stats;
+}
+
+uint64_t allocate_consecutive_physical_pages(size_t count) {
+	return _allocate_consecutive(count, 0, 0);
+}
+
 void free_consecutive_physical_pages(uint64_t page, size_t count) {
-	struct physical_map_entry **entry, *tmp;
-	uint64_t end, entry_end;
-	size_t diff;
+	uint64_t end;
 
 	end = page + count * PAGESIZE;
-	for (entry = &physical_map; *entry != NULL; entry = &(*entry)->next) {
-		entry_end = (*entry)->base + (*entry)->count * PAGESIZE;
+	if (page % PAGESIZE || !_frame_tracked(page) || (count && !_frame_tracked(end - PAGESIZE)))
+		panic("free_consecutive_physical_pages(): %p - %p is not tracked physical memory",
+			page, end);
 
-		if (_regions_overlap(page, end, (*entry)->base, entry_end))
-			panic("free_consecutive_physical_pages(): free'd pages overlap with already free region\n"
-				"Map Entry: %p - %p\n"
-				"User Free: %p - %p", (*entry)->base, entry_end, page, end);
+	_release_frames(page, count);
+	if (count == 1)
+		_page_cache_free(page);
+	else
+		_free_range(page, count);
+}
 
-		if (entry_end == page) {
-			_merge_into_below_region(*entry, page, count);
-			return;
-		} else if ((*entry)->base >= page) {
-			_insert_entry(entry, page, count);
-			return;
+void get_physical_page(uint64_t page) {
+	struct page *desc;
+
+	desc = phys_to_page(page);
+	if (!desc || !desc->refcount)
+		panic("get_physical_page(): page %p is not allocated", page);
+	desc->refcount++;
+}
+
+void put_physical_page(uint64_t page) {
+	struct page *desc;
+
+	desc = phys_to_page(page);
+	if (!desc || !desc->refcount)
+		panic("put_physical_page(): page %p is not allocated", page);
+	if (desc->refcount == 1)
+		free_consecutive_physical_pages(page, 1);
+	else
+		desc->refcount--;
+}
+
+void set_physical_page_owner(uint64_t page, size_t count, enum page_owner owner) {
+	for (; count; count--, page += PAGESIZE)
+		_page(page)->owner = owner;
+}
+
+/* Carves one run of at most count pages out of the free lists. A block */
+/* big enough for the whole request is preferred, then deferred memory is */
+/* initialized to find one, and only then is the largest free block taken */
+/* whole. The length of the run is stored in *got. */
+static uint64_t _allocate_extent(size_t count, size_t *got) {
+	unsigned order, k;
+	uint64_t page;
+
+	if (count == 1) {
+		page = allocate_consecutive_physical_pages(1);
+		*got = 1;
+		return page;
+	}
+
+	order = _order_for_count(count);
+	if (order > PHYS_MAX_ORDER)
+		order = PHYS_MAX_ORDER;
+
+	for (;;) {
+		for (k = order; k <= PHYS_MAX_ORDER; k++) {
+			if (_free_block_available(k)) {
+				page = _buddy_allocate(order);
+				*got = (size_t) 1 << order;
+				if (*got > count) {
+					_free_range(page + count * PAGESIZE, *got - count);
+					*got = count;
+				}
+				_claim_frames(page, *got, order);
+				return page;
+			}
 		}
+		if (initalize_deferred_memory())
+			continue;
+
+		for (k = order; k-- > 0;) {
+			if (_free_block_available(k)) {
+				page = _buddy_allocate(k);
+				*got = (size_t) 1 << k;
+				_claim_frames(page, *got, k);
+				return page;
+			}
+		}
+		if (!drain_physical_page_caches())
+			break;
 	}
 
-	_insert_entry(entry, page, count);
+	/* last resort, the memory held back for devices */
+	page = _zone_allocate(&dma_zone, 0);
+	if (page) {
+		*got = 1;
+		_claim_frames(page, 1, 0);
+	} else {
+		counters.failures++;
+	}
+	return page;
 }
 
-int allocate_physical_pages(uint64_t *pages, size_t count, unsigned flags) {
+size_t allocate_physical_extents(struct physical_extent *extents, size_t max, size_t count) {
+	size_t n, got;
+	uint64_t page;
+
+	n = 0;
+	while (count) {
+		page = _allocate_extent(count, &got);
+		if (!page)
+			goto fail;
+
+		if (n && extents[n - 1].base + extents[n - 1].count * PAGESIZE == page) {
+			extents[n - 1].count += got;
+		} else if (n < max) {
+			extents[n].base = page;
+			extents[n].count = got;
+			n++;
+		} else {
+			free_consecutive_physical_pages(page, got);
+			goto fail;
+		}
+		count -= got;
+	}
+
+	return n;
+
+fail:
+	free_physical_extents(extents, n);
+	return 0;
+}
+
+void free_physical_extents(struct physical_extent *extents, size_t n) {
 	size_t i;
 
+	for (i = 0; i < n; i++)
+		free_consecutive_physical_pages(extents[i].base, extents[i].count);
+}
+
+int allocate_physical_pages(uint64_t *pages, size_t count, unsigned flags) {
+	size_t i, got;
+	uint64_t page, run, limit;
+	unsigned align;
+
+	align = PHYS_PAGE_ALLOC_ALIGN_ORDER(flags);
+	limit = dma_limits[PHYS_PAGE_ALLOC_DMA_LIMIT(flags)];
+	if (flags & PHYS_PAGE_ALLOC_ZERO && count == 1 && !align && !limit) {
+		*pages = _zeroed_pool_allocate();
+		if (*pages)
+			return 0;
+	}
+
 	if (flags & PHYS_PAGE_ALLOC_CONSECUTIVE) {
-		*pages = allocate_consecutive_physical_pages(count);
+		*pages = _allocate_consecutive(count, align, limit);
 		if (!*pages)
 			return 1;
 
+	} else if (align) {
+		return 1;
+
 	} else {
-		for (i = 0; i < count; i++) {
-			pages[i] = allocate_consecutive_physical_pages(1);
-			if (!pages[i]) {
-				while (i--)
-					free_consecutive_physical_pages(pages[i], 1);
-				return 1;
+		for (i = 0; i < count; i += got) {
+			if (limit) {
+				page = _allocate_consecutive(1, 0, limit);
+				got = 1;
+			} else {
+				page = _allocate_extent(count - i, &got);
 			}
+			if (!page)
+				goto fail;
+			for (run = 0; run < got; run++)
+				pages[i + run] = page + run * PAGESIZE;
 		}
 	}
 
+	if (flags & PHYS_PAGE_ALLOC_ZERO) {
+		if (flags & PHYS_PAGE_ALLOC_CONSECUTIVE)
+			memset(physical_to_virtual(*pages), 0, count * PAGESIZE);
+		else
+			for (i = 0; i < count; i++)
+				memset(physical_to_virtual(pages[i]), 0, PAGESIZE);
+	}
+
 	return 0;
+
+fail:
+	/* pages was filled a run at a time, so give it back the same way */
+	while (i) {
+		for (run = 1; run < i && pages[i - run - 1] + PAGESIZE == pages[i - run]; run++)
+			;
+		i -= run;
+		free_consecutive_physical_pages(pages[i], run);
+	}
+	return 1;
 }
 
+/* The physical allocator keeps all of its metadata in the page frames */
+/* and in the free frames themselves, so it is primed first and never */
+/* depends on the heap. Heap growth through claim_new_memory() then works */
+/* as soon as the virtual allocator is up, rather than boot relying on the */
+/* seed page never running out. */
 void prime_allocators(void) {
+	initalize_physical_memory();
 	initalize_malloc();
 	initalize_virtual_memory();
-	initalize_physical_memory();
 }
 
-void release_bootstrap_used_memory(void) {
-	size_t i;
+/* Frees every whole page of the map entries of type release_type. */
+static size_t _release_memory_type(enum phys_mem_type release_type) {
+	size_t i, count;
 	uint64_t base, size;
 	enum phys_mem_type type;
 
+	count = 0;
 	for (i = 0; i < bootstrap_info.memory.count; i++) {
 		base = bootstrap_info.memory.map[i].base;
 		size = bootstrap_info.memory.map[i].size;
 		type = bootstrap_info.memory.map[i].type;
+		if (type != release_type)
+			continue;
+
 		if (base % PAGESIZE) {
+			if (size < PAGESIZE - base % PAGESIZE)
+				continue;
 			size -= PAGESIZE - base % PAGESIZE;
 			base += PAGESIZE - base % PAGESIZE;
 		}
 
-
-		if (type == PHYS_MEM_BOOTSTRAP_USED && size > PAGESIZE) 
+		if (size >= PAGESIZE) {
 			free_consecutive_physical_pages(base, size / PAGESIZE);
+			count += size / PAGESIZE;
+		}
 	}
+
+	return count;
+}
+
+static enum phys_mem_type _memory_type(uint64_t page) {
+	size_t i;
+	struct bootstrap_memory_map_entry *entry;
+
+	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		entry = &bootstrap_info.memory.map[i];
+		if (page >= entry->base && page - entry->base < entry->size)
+			return entry->type;
+	}
+	return PHYS_MEM_RESERVED;
+}
+
+size_t release_firmware_page(uint64_t page) {
+	struct page *desc;
+
+	desc = phys_to_page(page);
+	if (!desc || desc->refcount != 1 || desc->owner != PAGE_OWNER_BOOTSTRAP)
+		return 0;
+
+	/* boot services memory is freed as a whole by reclaim_boot_memory() */
+	if (_memory_type(page) != PHYS_MEM_USED)
+		return 0;
+
+	free_consecutive_physical_pages(page, 1);
+	return 1;
+}
+
+/* Boot services memory holds the uefi paging structures, so none of this */
+/* can be freed before unmap_lower_memory() has dropped the identity map. */
+size_t reclaim_boot_memory(void) {
+	size_t count;
+	uint64_t transition;
+
+	/* the transition pages stay in use, as the kernel pml4, the heap's */
+	/* paging structures and the heap's seed page */
+	transition = bootstrap_info.memory.transition_pages;
+	set_physical_page_owner(transition, BOOTSTRAP_TRANSITION_PAGE_COUNT - 1, PAGE_OWNER_PAGE_TABLE);
+	set_physical_page_owner(transition + (BOOTSTRAP_TRANSITION_PAGE_COUNT - 1) * PAGESIZE,
+		1, PAGE_OWNER_HEAP);
+
+	copy_acpi_tables();
+	initalize_numa();
+	_assign_zones();
+
+	count = release_uefi_page_tables();
+	count += _release_memory_type(PHYS_MEM_BOOTSTRAP_USED);
+	count += _release_memory_type(PHYS_MEM_ACPI_RECLAIMABLE);
+
+	/* and whatever the heap grew by during boot and no longer uses */
+	count += trim_heap(0) / PAGESIZE;
+	return count;
 }
 
 void initalize_memory(void) {
@@ -189,5 +1538,4 @@ void initalize_memory(void) {
 	prime_allocators();
 	map_high_physical_memory();
 	relocate_bootstrap_data();
-	release_bootstrap_used_memory();
 }
@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "memory.h"
+#include "terminal.h"
+
+#define SLAB_CACHE_LINE 64
+
+/* A slab is a single heap page. Its header sits at the start of the */
+/* page and is followed by the objects, so an object finds its slab by */
+/* rounding its address down, and objects carry no header of their own. */
+/* Free objects hold the link of the slab's free list, at the end of the */
+/* object if the cache has a constructor so that constructed state */
+/* survives being freed. */
+struct slab {
+	struct slab_cache *cache;
+	struct slab *next;
+	struct slab *prev;
+	uint64_t frame;
+	void *free;
+	size_t inuse;
+};
+
+struct slab_cache {
+	size_t size;
+	size_t stride; /* between objects */
+	size_t offset; /* of the first object */
+	size_t link; /* of the free list link within a free object */
+	size_t count; /* objects per slab */
+	size_t allocated;
+	void (*constructor)(void *object);
+	struct slab *partial; /* slabs with free objects */
+	struct slab *empty; /* one spare slab, so a cache does not thrash */
+};
+
+/* The caches themselves come from this one. */
+static struct slab_cache cache_cache;
+
+#define LINK(cache, object) (*(void **) ((uint8_t *) (object) + (cache)->link))
+
+static void _setup_cache(struct slab_cache *cache, size_t size, size_t align,
+		void (*constructor)(void *)) {
+	size_t stride;
+
+	stride = size;
+	if (constructor)
+		stride = (stride + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	cache->link = constructor ? stride : 0;
+	if (constructor)
+		stride += sizeof(void *);
+	else if (stride < sizeof(void *))
+		stride = sizeof(void *);
+
+	cache->size = size;
+	cache->stride = (stride + align - 1) & ~(align - 1);
+	cache->offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+	cache->count = (PAGESIZE - cache->offset) / cache->stride;
+	cache->constructor = constructor;
+	cache->allocated = 0;
+	cache->partial = NULL;
+	cache->empty = NULL;
+}
+
+struct slab_cache *create_slab_cache(size_t size, size_t align, void (*constructor)(void *)) {
+	struct slab_cache *cache;
+
+	if (!cache_cache.size)
+		_setup_cache(&cache_cache, sizeof(struct slab_cache), sizeof(void *), NULL);
+
+	if (!align)
+		align = SLAB_CACHE_LINE;
+	if (!size || align & (align - 1) || align < sizeof(void *))
+		return NULL;
+
+	cache = slab_allocate(&cache_cache);
+	if (!cache)
+		return NULL;
+
+	_setup_cache(cache, size, align, constructor);
+	if (!cache->count) {
+		slab_free(&cache_cache, cache);
+		return NULL;
+	}
+	return cache;
+}
+
+/* Slab pages are mapped into the heap, but owned by the kernel so that */
+/* compaction leaves them, and the frame recorded in the header, alone. */
+static struct slab *_create_slab(struct slab_cache *cache) {
+	struct slab *slab;
+	uint64_t vaddr, frame;
+	uint8_t *object;
+	size_t i;
+
+	if (allocate_physical_pages(&frame, 1, 0))
+		return NULL;
+	vaddr = allocate_virtual_pages(1);
+	if (!vaddr) {
+		free_consecutive_physical_pages(frame, 1);
+		return NULL;
+	}
+	set_physical_page_owner(frame, 1, PAGE_OWNER_KERNEL);
+	map_page_autoalloc(vaddr, frame, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+
+	slab = (struct slab *) vaddr;
+	slab->cache = cache;
+	slab->frame = frame;
+	slab->inuse = 0;
+	slab->free = NULL;
+
+	/* thread the free list so objects are handed out in address order */
+	object = (uint8_t *) slab + cache->offset + cache->stride * cache->count;
+	for (i = 0; i < cache->count; i++) {
+		object -= cache->stride;
+		if (cache->constructor)
+			cache->constructor(object);
+		LINK(cache, object) = slab->free;
+		slab->free = object;
+	}
+	return slab;
+}
+
+static void _destroy_slab(struct slab *slab) {
+	uint64_t vaddr, frame;
+
+	vaddr = (uint64_t) slab;
+	frame = slab->frame;
+	unmap_page(vaddr);
+	free_virtual_pages(vaddr, 1);
+	free_consecutive_physical_pages(frame, 1);
+}
+
+static void _link_partial(struct slab *slab) {
+	struct slab_cache *cache;
+
+	cache = slab->cache;
+	slab->prev = NULL;
+	slab->next = cache->partial;
+	if (slab->next)
+		slab->next->prev = slab;
+	cache->partial = slab;
+}
+
+static void _unlink_partial(struct slab *slab) {
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		slab->cache->partial = slab->next;
+}
+
+void *slab_allocate(struct slab_cache *cache) {
+	struct slab *slab;
+	void *object;
+
+	slab = cache->partial;
+	if (!slab) {
+		slab = cache->empty;
+		cache->empty = NULL;
+		if (!slab)
+			slab = _create_slab(cache);
+		if (!slab)
+			return NULL;
+		_link_partial(slab);
+	}
+
+	object = slab->free;
+	slab->free = LINK(cache, object);
+	slab->inuse++;
+	cache->allocated++;
+
+	/* full slabs are on no list until an object is freed */
+	if (!slab->free)
+		_unlink_partial(slab);
+	return object;
+}
+
+void slab_free(struct slab_cache *cache, void *object) {
+	struct slab *slab, *spare;
+
+	slab = (struct slab *) ((uint64_t) object & ~(uint64_t) (PAGESIZE - 1));
+	if (slab->cache != cache || slab->inuse == 0)
+		panic("slab_free(): %p is not an allocated object of cache %p", object, cache);
+
+	if (!slab->free)
+		_link_partial(slab);
+	LINK(cache, object) = slab->free;
+	slab->free = object;
+	cache->allocated--;
+	if (--slab->inuse)
+		return;
+
+	/* keep one empty slab, and release any other once it is off the lists, */
+	/* as releasing it may allocate from this very cache */
+	_unlink_partial(slab);
+	spare = cache->empty;
+	cache->empty = slab;
+	if (spare)
+		_destroy_slab(spare);
+}
+
+void destroy_slab_cache(struct slab_cache *cache) {
+	if (cache->allocated)
+		panic("destroy_slab_cache(): cache %p still has allocated objects", cache);
+	if (cache->empty)
+		_destroy_slab(cache->empty);
+	slab_free(&cache_cache, cache);
+}
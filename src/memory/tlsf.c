@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "memory.h"
+#include "terminal.h"
+#include "util.h"
+
+#define TLSF_MAGIC_USED UINT64_C(0x666c737466736c74)
+
+/* Blocks are laid out like those of malloc(): a used block is a tag */
+/* before the data, a free block a size and its list links, with its size */
+/* repeated in its last word so the block after it can find its start. */
+/* The low bits of the size are flags. */
+#define TLSF_GRANULE 16
+#define TLSF_MIN_BLOCK 32
+
+#define TLSF_IN_USE 1
+#define TLSF_PREV_FREE 2 /* the block before this one is free */
+#define TLSF_FLAGS (TLSF_GRANULE - 1)
+
+/* Free blocks are on one of SL_COUNT lists per power of two, the first */
+/* level, which split it into equal parts, the second level. Blocks below */
+/* SMALL_BLOCK_SIZE all share the first list of the first level, in steps */
+/* of TLSF_GRANULE. A bitmap per level finds the first non-empty list that */
+/* only holds blocks large enough, so both allocating and freeing take */
+/* constant time, whatever the pool holds. */
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 4) /* log2 of TLSF_GRANULE */
+#define FL_MAX 32 /* blocks are smaller than 4 GiB */
+#define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_SHIFT)
+
+#define BLOCK_SIZE(block) ((block)->size & ~(size_t) TLSF_FLAGS)
+#define NEXT_BLOCK(block) ((struct tlsf_block *) ((uint8_t *) (block) + BLOCK_SIZE(block)))
+
+struct tlsf_tag {
+	size_t size;
+	uint64_t magic;
+};
+
+struct tlsf_block {
+	size_t size;
+	struct tlsf_block *next;
+	struct tlsf_block *prev;
+};
+
+#define TAG_SIZE sizeof(struct tlsf_tag)
+
+struct tlsf_pool {
+	uint32_t fl_map;
+	uint32_t sl_map[FL_COUNT];
+	struct tlsf_block *lists[FL_COUNT][SL_COUNT];
+	size_t allocated; /* bytes, with the tags */
+	struct tlsf_block *first;
+	struct tlsf_tag *fence; /* ends the pool */
+};
+
+static unsigned _msb(size_t size) {
+	return 63 - __builtin_clzll(size);
+}
+
+static void _mapping(size_t size, unsigned *fl, unsigned *sl) {
+	unsigned bit;
+
+	if (size < SMALL_BLOCK_SIZE) {
+		*fl = 0;
+		*sl = size / (SMALL_BLOCK_SIZE / SL_COUNT);
+		return;
+	}
+	bit = _msb(size);
+	*sl = (size >> (bit - SL_LOG2)) ^ SL_COUNT;
+	*fl = bit - FL_SHIFT + 1;
+}
+
+static size_t *_footer(struct tlsf_block *block) {
+	return (size_t *) NEXT_BLOCK(block) - 1;
+}
+
+static void _insert(struct tlsf_pool *pool, struct tlsf_block *block) {
+	unsigned fl, sl;
+
+	_mapping(BLOCK_SIZE(block), &fl, &sl);
+	block->prev = NULL;
+	block->next = pool->lists[fl][sl];
+	if (block->next)
+		block->next->prev = block;
+	pool->lists[fl][sl] = block;
+	pool->sl_map[fl] |= UINT32_C(1) << sl;
+	pool->fl_map |= UINT32_C(1) << fl;
+}
+
+static void _remove(struct tlsf_pool *pool, struct tlsf_block *block) {
+	unsigned fl, sl;
+
+	_mapping(BLOCK_SIZE(block), &fl, &sl);
+	if (block->next)
+		block->next->prev = block->prev;
+	if (block->prev) {
+		block->prev->next = block->next;
+		return;
+	}
+
+	pool->lists[fl][sl] = block->next;
+	if (pool->lists[fl][sl])
+		return;
+	pool->sl_map[fl] &= ~(UINT32_C(1) << sl);
+	if (!pool->sl_map[fl])
+		pool->fl_map &= ~(UINT32_C(1) << fl);
+}
+
+/* Writes the tags of a free block of size bytes, which may carry */
+/* TLSF_PREV_FREE, and puts it on its list. */
+static void _make_free(struct tlsf_pool *pool, struct tlsf_block *block, size_t size) {
+	block->size = size;
+	*_footer(block) = BLOCK_SIZE(block);
+	NEXT_BLOCK(block)->size |= TLSF_PREV_FREE;
+	_insert(pool, block);
+}
+
+/* Returns the head of the first list whose blocks all hold size bytes. */
+/* size is rounded up to the next list, as the list it falls in may have */
+/* smaller blocks too. */
+static struct tlsf_block *_find_block(struct tlsf_pool *pool, size_t size) {
+	unsigned fl, sl;
+	uint32_t map;
+
+	if (size >= SMALL_BLOCK_SIZE)
+		size += (UINT64_C(1) << (_msb(size) - SL_LOG2)) - 1;
+	_mapping(size, &fl, &sl);
+	if (fl >= FL_COUNT)
+		return NULL;
+
+	map = pool->sl_map[fl] & (~UINT32_C(0) << sl);
+	if (!map) {
+		map = pool->fl_map & (~UINT32_C(0) << fl << 1);
+		if (!map)
+			return NULL;
+		fl = __builtin_ctz(map);
+		map = pool->sl_map[fl];
+	}
+	return pool->lists[fl][__builtin_ctz(map)];
+}
+
+struct tlsf_pool *create_tlsf_pool(size_t size) {
+	struct tlsf_pool *pool;
+	struct tlsf_tag *fence;
+	size_t offset, i;
+
+	size = (size + TLSF_GRANULE - 1) & ~(size_t) (TLSF_GRANULE - 1);
+	if (size < TLSF_MIN_BLOCK || size >= (UINT64_C(1) << FL_MAX) - TAG_SIZE)
+		return NULL;
+
+	/* the pool is mapped up front, never grows and is pinned, so nothing */
+	/* it does can fault, go to the page allocators or be moved */
+	offset = (sizeof(struct tlsf_pool) + TLSF_GRANULE - 1) & ~(size_t) (TLSF_GRANULE - 1);
+	pool = malloc_aligned(offset + size + TAG_SIZE, TLSF_GRANULE);
+	if (!pool)
+		return NULL;
+	pin_heap_memory(pool, offset + size + TAG_SIZE);
+
+	pool->fl_map = 0;
+	pool->allocated = 0;
+	for (i = 0; i < FL_COUNT; i++) {
+		pool->sl_map[i] = 0;
+		memset(pool->lists[i], 0, sizeof(pool->lists[i]));
+	}
+
+	/* a block that is always in use ends the pool, so merging stops */
+	pool->first = (struct tlsf_block *) ((uint8_t *) pool + offset);
+	fence = (struct tlsf_tag *) ((uint8_t *) pool->first + size);
+	pool->fence = fence;
+	fence->size = TAG_SIZE | TLSF_IN_USE;
+	fence->magic = TLSF_MAGIC_USED;
+	_make_free(pool, pool->first, size);
+	return pool;
+}
+
+void destroy_tlsf_pool(struct tlsf_pool *pool) {
+	if (pool->allocated)
+		panic("destroy_tlsf_pool(): pool %p still has allocated blocks", pool);
+	free(pool);
+}
+
+void *tlsf_allocate(struct tlsf_pool *pool, size_t size) {
+	struct tlsf_block *block, *rest;
+	struct tlsf_tag *tag;
+	size_t allocsize;
+
+	if (!size || size >= (UINT64_C(1) << FL_MAX) - TAG_SIZE)
+		return NULL;
+	allocsize = (size + TAG_SIZE + TLSF_GRANULE - 1) & ~(size_t) (TLSF_GRANULE - 1);
+	if (allocsize < TLSF_MIN_BLOCK)
+		allocsize = TLSF_MIN_BLOCK;
+
+	block = _find_block(pool, allocsize);
+	if (!block)
+		return NULL;
+	_remove(pool, block);
+
+	if (BLOCK_SIZE(block) - allocsize >= TLSF_MIN_BLOCK) {
+		rest = (struct tlsf_block *) ((uint8_t *) block + allocsize);
+		_make_free(pool, rest, BLOCK_SIZE(block) - allocsize);
+	} else {
+		allocsize = BLOCK_SIZE(block);
+		NEXT_BLOCK(block)->size &= ~(size_t) TLSF_PREV_FREE;
+	}
+
+	tag = (struct tlsf_tag *) block;
+	tag->size = allocsize | (block->size & TLSF_PREV_FREE) | TLSF_IN_USE;
+	tag->magic = TLSF_MAGIC_USED;
+	pool->allocated += allocsize;
+	return tag + 1;
+}
+
+void tlsf_free(struct tlsf_pool *pool, void *ptr) {
+	struct tlsf_block *block, *next;
+	struct tlsf_tag *tag;
+	size_t size;
+
+	if (!ptr)
+		return;
+
+	tag = (struct tlsf_tag *) ptr - 1;
+	if ((uint8_t *) tag < (uint8_t *) pool->first || tag >= pool->fence ||
+			tag->magic != TLSF_MAGIC_USED || !(tag->size & TLSF_IN_USE))
+		panic("tlsf_free(): %p was not allocated from pool %p", ptr, pool);
+	tag->magic = 0;
+
+	block = (struct tlsf_block *) tag;
+	size = BLOCK_SIZE(block);
+	pool->allocated -= size;
+
+	next = NEXT_BLOCK(block);
+	if (!(next->size & TLSF_IN_USE)) {
+		_remove(pool, next);
+		size += BLOCK_SIZE(next);
+	}
+	if (block->size & TLSF_PREV_FREE) {
+		block = (struct tlsf_block *) ((uint8_t *) block - *((size_t *) block - 1));
+		_remove(pool, block);
+		size += BLOCK_SIZE(block);
+	}
+	_make_free(pool, block, size);
+}
@@ -7,10 +7,10 @@
 #include "bootstrap.h"
 
 static pml4e_t *pml4;
+static uint64_t uefi_pml4;
 static int _physical_map_initalized;
 
 void bootstrap_higher_half_heap_table(void) {
-	pml4e_t *uefi_pml4;
 	pdpte_t *heap_pdpt;
 	pde_t *heap_pd;
 	pte_t *heap_pt;
@@ -26,8 +26,8 @@ void bootstrap_higher_half_heap_table(void) {
 	heap_pt = (pte_t *) (bootstrap_info.memory.transition_pages + PAGESIZE * 3);
 	heap_seed_page = (pte_t) (bootstrap_info.memory.transition_pages + PAGESIZE * 4);
 
-	uefi_pml4 = (pml4e_t *) (read_cr3() & PAGEMASK);
-	memcpy(pml4, uefi_pml4, 0x80 * sizeof(pml4e_t));
+	uefi_pml4 = read_cr3() & PAGE_ADDRESS_MASK;
+	memcpy(pml4, (void *) uefi_pml4, 0x80 * sizeof(pml4e_t));
 
 	flags = PAGE_PRESENT | PAGE_WRITABLE;
 	pml4[(KERNEL_HEAP_BOTTOM >> 39) & 0x1ff] = (pml4e_t) heap_pdpt | flags;
@@ -37,6 +37,12 @@ void bootstrap_higher_half_heap_table(void) {
 	write_cr3((uint64_t) pml4);
 }
 
+void *physical_to_virtual(uint64_t paddr) {
+	if (_physical_map_initalized)
+		return P2VADDR(paddr);
+	return (void *) paddr;
+}
+
 struct virtual_map_entry {
 	uint64_t base;
 	size_t count;
@@ -45,20 +51,18 @@ struct virtual_map_entry {
 };
 
 struct virtual_map_entry *virtual_map;
+static struct slab_cache *virtual_map_cache;
 
 /* Walks the paging structures and finds the entry of table at index. If */
-/* there is no entry, it will allocate the frame and zero it. This returns */
+/* there is no entry, it will allocate a zeroed frame for it. This returns */
 /* a pointer, but it is into physical memory, hence the name. */
 static uint64_t *_walk_paging_autoalloc_physical(uint64_t *table, uint16_t index) {
 	uint64_t frame;
 	if (!(table[index] & PAGE_PRESENT)) {
-		if (allocate_physical_pages(&frame, 1, 0))
+		if (allocate_physical_pages(&frame, 1, PHYS_PAGE_ALLOC_ZERO))
 			panic("unable to allocate memory paging structure");
+		set_physical_page_owner(frame, 1, PAGE_OWNER_PAGE_TABLE);
 		table[index] = frame | PAGE_PRESENT | PAGE_WRITABLE;
-		if (_physical_map_initalized)
-			memset(P2VADDR(frame), 0, PAGESIZE);
-		else
-			memset((void *) frame, 0, PAGESIZE);
 	}
 
 	return (uint64_t *) (table[index] & PAGEMASK);
@@ -78,22 +82,239 @@ void map_page_autoalloc(uint64_t vaddr, uint64_t paddr, uint64_t flags) {
 	pdi = vaddr >> 21 & 0x1ff;
 	pti = vaddr >> 12 & 0x1ff;
 
-	pdpt = P2VADDR(_walk_paging_autoalloc_physical(pml4, pml4i));
-	pd = P2VADDR(_walk_paging_autoalloc_physical(pdpt, pdpti));
-	pt = P2VADDR(_walk_paging_autoalloc_physical(pd, pdi));
+	pdpt = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(
+		physical_to_virtual((uint64_t) pml4), pml4i));
+	pd = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(pdpt, pdpti));
+	pt = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(pd, pdi));
 
 	pt[pti] = paddr | flags;
 	flush_page(vaddr);
 }
 
+/* Clears the mapping of vaddr, if it has one, and returns the frame it */
+/* mapped, or 0. The frame is left alone. */
+uint64_t unmap_page(uint64_t vaddr) {
+	uint64_t *table, entry;
+	int shift;
+
+	table = physical_to_virtual((uint64_t) pml4);
+	for (shift = 39; shift > 12; shift -= 9) {
+		entry = table[vaddr >> shift & 0x1ff];
+		if (!(entry & PAGE_PRESENT))
+			return 0;
+		if (shift < 39 && entry & PAGE_LARGE)
+			panic("unmap_page(): %p is mapped by a large page", vaddr);
+		table = physical_to_virtual(entry & PAGE_ADDRESS_MASK);
+	}
+
+	entry = table[vaddr >> 12 & 0x1ff];
+	if (!(entry & PAGE_PRESENT))
+		return 0;
+	table[vaddr >> 12 & 0x1ff] = 0;
+	flush_page(vaddr);
+	return entry & PAGE_ADDRESS_MASK;
+}
+
+/* Returns the frame that backs vaddr, or 0 if it is not mapped. */
+uint64_t lookup_frame(uint64_t vaddr) {
+	uint64_t *table, entry;
+	int shift;
+
+	table = physical_to_virtual((uint64_t) pml4);
+	for (shift = 39; shift > 12; shift -= 9) {
+		entry = table[vaddr >> shift & 0x1ff];
+		if (!(entry & PAGE_PRESENT))
+			return 0;
+		if (shift < 39 && entry & PAGE_LARGE)
+			return (entry & PAGE_ADDRESS_MASK & ~((UINT64_C(1) << shift) - 1)) |
+				(vaddr & ((UINT64_C(1) << shift) - 1) & PAGEMASK);
+		table = physical_to_virtual(entry & PAGE_ADDRESS_MASK);
+	}
+
+	entry = table[vaddr >> 12 & 0x1ff];
+	if (!(entry & PAGE_PRESENT))
+		return 0;
+	return entry & PAGE_ADDRESS_MASK;
+}
+
+/* Whether every page of [base, base + size) is mapped present, user and */
+/* writable in the active address space, at every level of the walk. */
+int user_range_writable(uint64_t base, size_t size) {
+	uint64_t *table, entry, vaddr, end, required;
+	int shift;
+
+	required = PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE;
+	end = base + size;
+	for (vaddr = base & PAGEMASK; vaddr < end; vaddr += PAGESIZE) {
+		table = physical_to_virtual(read_cr3() & PAGE_ADDRESS_MASK);
+		for (shift = 39; shift >= 12; shift -= 9) {
+			entry = table[vaddr >> shift & 0x1ff];
+			if ((entry & required) != required)
+				return 0;
+			if (shift == 12 || (shift < 39 && entry & PAGE_LARGE))
+				break;
+			table = physical_to_virtual(entry & PAGE_ADDRESS_MASK);
+		}
+	}
+	return 1;
+}
+
+/* Maps count pages at vaddr to the consecutive frames at paddr, walking */
+/* the paging structures once per table rather than once per page. With */
+/* PAGE_LARGE in flags, 2 MiB pages are used wherever vaddr and paddr are */
+/* both aligned for one. The range must not be mapped yet, and as entries */
+/* that are not present are never cached, no TLB entries are flushed, */
+/* except where a 2 MiB page replaces a page table left empty by an */
+/* earlier unmap. That table is freed. */
+void map_pages(uint64_t vaddr, uint64_t paddr, size_t count, uint64_t flags) {
+	uint64_t *pdpt, *pd, *pt;
+	uint64_t end, next, table;
+	uint16_t pdi;
+
+	end = vaddr + count * PAGESIZE;
+	while (vaddr < end) {
+		next = (vaddr + LARGE_PAGESIZE) & ~(uint64_t) (LARGE_PAGESIZE - 1);
+		if (next > end)
+			next = end;
+
+		pdpt = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(
+			physical_to_virtual((uint64_t) pml4), vaddr >> 39 & 0x1ff));
+		pd = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(pdpt, vaddr >> 30 & 0x1ff));
+		pdi = vaddr >> 21 & 0x1ff;
+
+		if (flags & PAGE_LARGE && next - vaddr == LARGE_PAGESIZE && !(paddr % LARGE_PAGESIZE)) {
+			table = pd[pdi];
+			pd[pdi] = paddr | flags;
+			if (table & PAGE_PRESENT) {
+				flush_page(vaddr);
+				free_consecutive_physical_pages(table & PAGE_ADDRESS_MASK, 1);
+			}
+			paddr += LARGE_PAGESIZE;
+			vaddr = next;
+			continue;
+		}
+
+		pt = physical_to_virtual((uint64_t) _walk_paging_autoalloc_physical(pd, pdi));
+		for (; vaddr < next; vaddr += PAGESIZE, paddr += PAGESIZE)
+			pt[vaddr >> 12 & 0x1ff] = paddr | (flags & ~(uint64_t) PAGE_LARGE);
+	}
+}
+
+/* Returns the page directory covering vaddr, or NULL if it has none. */
+static uint64_t *_page_directory(uint64_t vaddr) {
+	uint64_t *table, entry;
+	int shift;
+
+	table = physical_to_virtual((uint64_t) pml4);
+	for (shift = 39; shift > 21; shift -= 9) {
+		entry = table[vaddr >> shift & 0x1ff];
+		if (!(entry & PAGE_PRESENT))
+			return NULL;
+		if (shift < 39 && entry & PAGE_LARGE)
+			panic("_page_directory(): %p is mapped by a huge page", vaddr);
+		table = physical_to_virtual(entry & PAGE_ADDRESS_MASK);
+	}
+	return table;
+}
+
+/* Replaces the 2 MiB page in the directory entry pde, which maps vaddr, */
+/* by a table of 4 KiB pages mapping the same frames. */
+static void _split_large_page(uint64_t *pde, uint64_t vaddr) {
+	uint64_t table, frame, flags, *pt;
+	size_t i;
+
+	if (allocate_physical_pages(&table, 1, 0))
+		panic("unable to allocate memory paging structure");
+	set_physical_page_owner(table, 1, PAGE_OWNER_PAGE_TABLE);
+
+	frame = *pde & PAGE_ADDRESS_MASK & ~(uint64_t) (LARGE_PAGESIZE - 1);
+	flags = *pde & ~PAGE_ADDRESS_MASK & ~(uint64_t) PAGE_LARGE;
+	pt = physical_to_virtual(table);
+	for (i = 0; i < 512; i++)
+		pt[i] = (frame + i * PAGESIZE) | flags;
+
+	*pde = table | PAGE_PRESENT | PAGE_WRITABLE;
+	flush_page(vaddr);
+}
+
+/* Adds pages frames at frame to the run being collected, handing the run */
+/* to release() first if they do not continue it. */
+static void _collect_frames(uint64_t *run, size_t *length, uint64_t frame, size_t pages,
+		void (*release)(uint64_t frame, size_t count)) {
+	if (*length && *run + *length * PAGESIZE == frame) {
+		*length += pages;
+		return;
+	}
+	if (*length)
+		release(*run, *length);
+	*run = frame;
+	*length = pages;
+}
+
+/* Unmaps count pages at vaddr, a table at a time, and hands their frames */
+/* to release() a consecutive run at a time. The frames are left alone */
+/* otherwise. A 2 MiB page the range only covers part of is split first. */
+void unmap_pages(uint64_t vaddr, size_t count, void (*release)(uint64_t frame, size_t count)) {
+	uint64_t *pd, *pt;
+	uint64_t end, next, run;
+	size_t length;
+	uint16_t pdi, pti;
+
+	run = 0;
+	length = 0;
+	end = vaddr + count * PAGESIZE;
+	for (; vaddr < end; vaddr = next) {
+		next = (vaddr + LARGE_PAGESIZE) & ~(uint64_t) (LARGE_PAGESIZE - 1);
+		if (next > end)
+			next = end;
+
+		pd = _page_directory(vaddr);
+		pdi = vaddr >> 21 & 0x1ff;
+		if (!pd || !(pd[pdi] & PAGE_PRESENT))
+			continue;
+
+		if (pd[pdi] & PAGE_LARGE && next - vaddr == LARGE_PAGESIZE) {
+			_collect_frames(&run, &length, pd[pdi] & PAGE_ADDRESS_MASK,
+				LARGE_PAGESIZE / PAGESIZE, release);
+			pd[pdi] = 0;
+			flush_page(vaddr);
+			continue;
+		}
+		if (pd[pdi] & PAGE_LARGE)
+			_split_large_page(&pd[pdi], vaddr);
+
+		pt = physical_to_virtual(pd[pdi] & PAGE_ADDRESS_MASK);
+		for (; vaddr < next; vaddr += PAGESIZE) {
+			pti = vaddr >> 12 & 0x1ff;
+			if (!(pt[pti] & PAGE_PRESENT))
+				continue;
+			_collect_frames(&run, &length, pt[pti] & PAGE_ADDRESS_MASK, 1, release);
+			pt[pti] = 0;
+			flush_page(vaddr);
+		}
+	}
+	if (length)
+		release(run, length);
+}
+
+/* The map entries live in a slab cache, which itself allocates virtual */
+/* pages, so the first slab is carved out of a temporary entry. */
 void initalize_virtual_memory(void) {
-	virtual_map = malloc(sizeof(struct virtual_map_entry));
+	struct virtual_map_entry boot_entry;
+
+	boot_entry.base = KERNEL_HEAP_BOTTOM + PAGESIZE;
+	boot_entry.count = (KERNEL_HEAP_TOP - (KERNEL_HEAP_BOTTOM + PAGESIZE)) / PAGESIZE;
+	boot_entry.next = NULL;
+	boot_entry.prev = NULL;
+	virtual_map = &boot_entry;
+
+	virtual_map_cache = create_slab_cache(sizeof(struct virtual_map_entry), sizeof(void *), NULL);
+	if (!virtual_map_cache)
+		panic("Unable to allocate memory for virtual map");
+	virtual_map = slab_allocate(virtual_map_cache);
 	if (!virtual_map)
 		panic("Unable to allocate memory for virtual map");
-
-	virtual_map->base = KERNEL_HEAP_BOTTOM + PAGESIZE;
-	virtual_map->count = (KERNEL_HEAP_TOP - (KERNEL_HEAP_BOTTOM + PAGESIZE)) / PAGESIZE;
-	virtual_map->next = NULL;
+	*virtual_map = boot_entry;
 }
 
 static void relocate_framebuffer(void) {
@@ -177,8 +398,9 @@ uint64_t allocate_virtual_pages(size_t count) {
 				entry->prev->next = entry->next;
 			if (entry == virtual_map)
 				virtual_map = entry->next;
-			free(entry);
+			slab_free(virtual_map_cache, entry);
 		}
+		break;
 	}
 
 	return base;
@@ -207,10 +429,10 @@ void free_virtual_pages(uint64_t base, size_t count) {
 		entry_end = (*entry)->base + (*entry)->count * PAGESIZE;
 		if (base < (*entry)->base) {
 			if (allocation_end == (*entry)->base) {
-				(*entry)->base = allocation_end;
+				(*entry)->base = base;
 				(*entry)->count += count;
 			} else {
-				tmp = malloc(sizeof(struct virtual_map_entry));
+				tmp = slab_allocate(virtual_map_cache);
 				if (!tmp)
 					panic("free_virtual_pages(): map entry allocation failed");
 				tmp->base = base;
@@ -226,18 +448,19 @@ void free_virtual_pages(uint64_t base, size_t count) {
 		if (entry_end == base) {
 			(*entry)->count += count;
 			entry_end += count * PAGESIZE;
-			if (entry_end == (*entry)->next->base) {
+			if ((*entry)->next && entry_end == (*entry)->next->base) {
 				tmp = (*entry)->next;
 				(*entry)->count += tmp->count;
 				(*entry)->next = tmp->next;
-				(*entry)->next->prev = *entry;
-				free(tmp);
+				if ((*entry)->next)
+					(*entry)->next->prev = *entry;
+				slab_free(virtual_map_cache, tmp);
 			}
 			return;
 		}
 
 		if ((*entry)->next == NULL) {
-			tmp = malloc(sizeof(struct virtual_map_entry));
+			tmp = slab_allocate(virtual_map_cache);
 			if (!tmp)
 				panic("free_virtual_pages(): map entry allocation failed");
 			tmp->base = base;
@@ -251,54 +474,102 @@ void free_virtual_pages(uint64_t base, size_t count) {
 }
 
 
-/* This allocates memory for the page tables, and caches the table address */
-/* from the last call, to speed up calling on consecutive pages. This */
-/* function does NOT invalidate the TLB entry, this should be done by the */
-/* caller, this function is specialize for map_high_physical_memory(). */
-static void _map_page_autoalloc_cache(uint64_t paddr) {
+/* Heap pages are only reached through their heap mapping, so a heap */
+/* frame can be swapped for another one by copying it and rewriting its */
+/* page table entry. Every heap page backed by a frame in [base, end) is */
+/* offered to replace(), which returns the frame to move it to, or 0 to */
+/* leave it. Returns the number of pages moved. */
+size_t remap_heap_frames(uint64_t base, uint64_t end, uint64_t (*replace)(uint64_t frame)) {
+	uint64_t *top, *pdpt, *pd, *pt;
+	uint64_t frame, moved, vaddr;
+	size_t i, j, k, l, count;
+
+	count = 0;
+	top = physical_to_virtual((uint64_t) pml4);
+	for (i = KERNEL_HEAP_BOTTOM >> 39 & 0x1ff; i < (KERNEL_HEAP_TOP >> 39 & 0x1ff); i++) {
+		if (!(top[i] & PAGE_PRESENT))
+			continue;
+		pdpt = physical_to_virtual(top[i] & PAGE_ADDRESS_MASK);
+		for (j = 0; j < 512; j++) {
+			if (!(pdpt[j] & PAGE_PRESENT) || pdpt[j] & PAGE_LARGE)
+				continue;
+			pd = physical_to_virtual(pdpt[j] & PAGE_ADDRESS_MASK);
+			for (k = 0; k < 512; k++) {
+				if (!(pd[k] & PAGE_PRESENT) || pd[k] & PAGE_LARGE)
+					continue;
+				pt = physical_to_virtual(pd[k] & PAGE_ADDRESS_MASK);
+				for (l = 0; l < 512; l++) {
+					frame = pt[l] & PAGE_ADDRESS_MASK;
+					if (!(pt[l] & PAGE_PRESENT) || frame < base || frame >= end)
+						continue;
+
+					moved = replace(frame);
+					if (!moved)
+						continue;
+
+					/* sign extended, the heap is in the upper half */
+					vaddr = UINT64_C(0xffff000000000000) | i << 39 | j << 30 | k << 21 | l << 12;
+					memcpy(physical_to_virtual(moved), physical_to_virtual(frame), PAGESIZE);
+					pt[l] = moved | (pt[l] & ~PAGE_ADDRESS_MASK);
+					flush_page(vaddr);
+					count++;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Maps [base, end) at P2VADDR(base). Every aligned 2 MiB stretch gets a */
+/* single large page, and only the unaligned edges are mapped 4 KiB at a */
+/* time, so the work is proportional to the number of 2 MiB blocks rather */
+/* than pages. This function does NOT invalidate the TLB, it is meant for */
+/* map_high_physical_memory(), which reloads cr3 once at the end. */
+static void _map_high_range(uint64_t base, uint64_t end) {
 	uint64_t vaddr;
-	uint64_t page_index;
 	pdpte_t *pdpt;
 	pde_t *pd;
-	pte_t *table;
-	static uint64_t prev_page_index;
-	static pte_t *prev_table;
-	uint16_t pml4i, pdpti, pdi, pti;
-
-
-	paddr &= PAGEMASK;
-	vaddr = (uint64_t) P2VADDR(paddr);
+	pte_t *pt;
+	uint64_t flags;
 
-	page_index = vaddr & UINT64_C(0xffffffffffe00000);
-	if (!prev_page_index || prev_page_index != page_index) {
-		pml4i = vaddr >> 39 & 0x1ff;	
-		pdpti = vaddr >> 30 & 0x1ff;
-		pdi = vaddr >> 21 & 0x1ff;
+	flags = PAGE_PRESENT | PAGE_WRITABLE;
+	base &= PAGEMASK;
+	while (base < end) {
+		vaddr = (uint64_t) P2VADDR(base);
+		pdpt = _walk_paging_autoalloc_physical(pml4, vaddr >> 39 & 0x1ff);
+		pd = _walk_paging_autoalloc_physical(pdpt, vaddr >> 30 & 0x1ff);
+
+		if (base % LARGE_PAGESIZE == 0 && end - base >= LARGE_PAGESIZE) {
+			pd[vaddr >> 21 & 0x1ff] = base | flags | PAGE_LARGE;
+			base += LARGE_PAGESIZE;
+			continue;
+		}
 
-		pdpt = _walk_paging_autoalloc_physical(pml4, pml4i);
-		pd = _walk_paging_autoalloc_physical(pdpt, pdpti);
-		table = _walk_paging_autoalloc_physical(pd, pdi);
-		
-		prev_page_index = page_index;
-		prev_table = table;
+		pt = _walk_paging_autoalloc_physical(pd, vaddr >> 21 & 0x1ff);
+		do {
+			pt[(uint64_t) P2VADDR(base) >> 12 & 0x1ff] = base | flags;
+			base += PAGESIZE;
+		} while (base < end && base % LARGE_PAGESIZE);
 	}
-
-	
-	pti = vaddr >> 12 & 0x1ff;
-	table[pti] = paddr | PAGE_PRESENT | PAGE_WRITABLE;
 }
 
+/* Every range with contents the kernel may need is mapped: usable memory, */
+/* ACPI tables and firmware nonvolatile storage. Reserved ranges, which */
+/* are mostly MMIO, are skipped, drivers map what they need themselves */
+/* and firmware tables are mapped with map_high_physical_range(). */
 void map_high_physical_memory(void) {
 	size_t i;
 	uint64_t base;
 	uint64_t end;
 
 	for (i = 0; i < bootstrap_info.memory.count; i++) {
+		if (bootstrap_info.memory.map[i].type == PHYS_MEM_RESERVED)
+			continue;
+
 		base = bootstrap_info.memory.map[i].base;
 		end = base + bootstrap_info.memory.map[i].size;
-
-		for (; base < end; base += PAGESIZE)
-			_map_page_autoalloc_cache(base);
+		_map_high_range(base, end);
 	}
 
 	write_cr3(read_cr3());
@@ -310,3 +581,67 @@ void unmap_lower_memory(void) {
 	memset(pml4, 0, 256 * 8);
 	write_cr3(read_cr3());
 }
+
+/* Whether the frame at paddr can be reached through the high map, which */
+/* leaves out reserved memory. */
+static int _high_mapped(uint64_t paddr) {
+	uint64_t *table, entry, vaddr;
+	int shift;
+
+	vaddr = (uint64_t) P2VADDR(paddr);
+	table = physical_to_virtual((uint64_t) pml4);
+	for (shift = 39; shift >= 12; shift -= 9) {
+		entry = table[vaddr >> shift & 0x1ff];
+		if (!(entry & PAGE_PRESENT))
+			return 0;
+		if (shift < 39 && entry & PAGE_LARGE)
+			return 1;
+		table = physical_to_virtual(entry & PAGE_ADDRESS_MASK);
+	}
+	return 1;
+}
+
+/* Maps the frames of [paddr, paddr + size) that the high map leaves out */
+/* at their usual high address, for firmware tables in reserved memory. */
+void map_high_physical_range(uint64_t paddr, size_t size) {
+	uint64_t page, end;
+
+	end = paddr + size;
+	for (page = paddr & PAGEMASK; page < end; page += PAGESIZE)
+		if (!_high_mapped(page))
+			map_page_autoalloc((uint64_t) P2VADDR(page), page, PAGE_PRESENT | PAGE_WRITABLE);
+}
+
+/* level is 4 for a pml4 down to 1 for a page table. Firmware may keep its */
+/* tables in reserved memory, which is not in the high map, and is never */
+/* released anyway, so such tables are left alone with all they point to. */
+static size_t _release_uefi_table(uint64_t table, int level) {
+	uint64_t *entries;
+	size_t i, count;
+
+	if (!_high_mapped(table))
+		return 0;
+
+	count = 0;
+	if (level > 1) {
+		entries = physical_to_virtual(table);
+		for (i = 0; i < 512; i++) {
+			if (!(entries[i] & PAGE_PRESENT) || (level < 4 && entries[i] & PAGE_LARGE))
+				continue;
+			count += _release_uefi_table(entries[i] & PAGE_ADDRESS_MASK, level - 1);
+		}
+	}
+
+	return count + release_firmware_page(table);
+}
+
+size_t release_uefi_page_tables(void) {
+	size_t count;
+
+	if (!uefi_pml4)
+		return 0;
+
+	count = _release_uefi_table(uefi_pml4, 4);
+	uefi_pml4 = 0;
+	return count;
+}
@@ -2,6 +2,9 @@
 #include "cpu.h"
 #include "kernel.h"
 #include "terminal.h"
+#include "memory.h"
+#include "syscall.h"
+#include "util.h"
 
 #define SYSCALL_SUPERVISOR_SEGMENTS 8
 #define SYSCALL_USER_SEGMENTS 0x28
@@ -21,7 +24,33 @@ void initalize_syscall(void) {
 	write_msr(IA32_LSTAR, (uint64_t) &syscall_stub);
 }
 
+/* Lowest address outside of the lower half, where user memory lives. */
+#define USER_ADDRESS_LIMIT UINT64_C(0x0000800000000000)
+
+static int _user_range_valid(uint64_t base, uint64_t size) {
+	return base && base < USER_ADDRESS_LIMIT && size <= USER_ADDRESS_LIMIT - base;
+}
+
+/* The destination is checked against the page tables before anything is */
+/* written, there is no recovery from a fault in the kernel. */
+static uint64_t _sys_memory_stats(uint64_t buffer) {
+	struct physical_memory_stats stats;
+
+	if (!_user_range_valid(buffer, sizeof(stats)) || !user_range_writable(buffer, sizeof(stats)))
+		return 1;
+
+	get_physical_memory_stats(&stats);
+	memcpy((void *) buffer, &stats, sizeof(stats));
+	return 0;
+}
+
 void syscall_handler(struct registers *regs){
+	switch (regs->rax) {
+		case SYSCALL_MEMORY_STATS:
+			regs->rax = _sys_memory_stats(regs->rdi);
+			return;
+	}
+
 	printf("Recieved syscall\n");
 	printf("rax: %p rbx: %p\n", regs->rax, regs->rbx);
 	printf("rcx: %p rdx: %p\n", regs->rcx, regs->rdx);